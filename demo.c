@@ -53,11 +53,10 @@ int main(void)
   for (int i = 0; i < LP_ROWS; ++i)
     for (int j = 0; j < LP_COLS; ++j)
       notes[i * LP_ROWS + j] = LP_NOTE(LP_NOTE_OFF, LP_KEY(i,j), 0);
+  LPNoteColor frame[LP_LEDS] = {0};
   
   LPEvent event = {0};
   bool loop = true;
-  double delta_time = 0.0;
-  double fps = 30.0;
   struct timespec frame_start, frame_end;
   
   double generate_delta_time = 0.0;
@@ -69,8 +68,6 @@ int main(void)
   while(loop)
   {
     clock_gettime(CLOCK_MONOTONIC, &frame_start);
-    if (delta_time < 1 / fps) goto next;
-    delta_time = 0.0;
         
     if (lp_check_event(&lp, &event) > 0)
     {
@@ -103,16 +100,17 @@ int main(void)
         LP_NOTE(LP_NOTE_ON, LP_KEY(random_row, random_col), LP_COLOR_GREEN_FULL);
     }
     
-    lp_set_notes(&lp, notes);
+    // Only the notes that changed are sent to the device
+    for (int i = 0; i < LP_ROWS * LP_COLS; ++i)
+      frame[i] = (notes[i].state == LP_NOTE_ON) ? notes[i].color : 0;
+    lp_present(&lp, frame);
 
-  next:
-    // Wait a little bit
-    nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
+    // Wait for the next frame, as fast as the device can keep up with
+    lp_pace(&lp);
     
     clock_gettime(CLOCK_MONOTONIC, &frame_end);
     double diff = (frame_end.tv_sec - frame_start.tv_sec)
       + (frame_end.tv_nsec - frame_start.tv_nsec) / 1e9;
-    delta_time += diff;
     generate_delta_time += diff;
     continue;
 
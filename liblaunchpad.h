@@ -73,6 +73,44 @@
 // of 16 and is 9 notes long. In this library you can index the grid
 // by rows and columns from 0 to 8, which is nicer, using `lp_set_note`
 // or `lp_set_notes`. Notes can either be ON or OFF, with a color value.
+// The Automap buttons are reached with LP_KEY_AUTOMAP, and
+// `lp_set_leds` sets any mix of keys, including the scene launch
+// column, in a single write.
+//
+// Layouts
+// -------
+//
+// The device maps its keys to notes either in the X-Y layout, where
+// each row starts with a multiple of 16, or in the drum rack layout,
+// where notes go up from 36 in blocks of four columns. Pick one with
+// the `layout` field of `LPOptions`: keys are always given with
+// LP_KEY, and the library translates them to the notes of the layout
+// and back with a lookup in a table of 128 entries each way.
+//
+// Capabilities
+// ------------
+//
+// With the `probe` option, `lp_open_ex` sends the MIDI device inquiry
+// and tells from the reply which model is connected and its firmware
+// version, see `lp_get_capabilities`. Functions that need a feature
+// the model lacks, like text scrolling on the original Launchpad,
+// return LP_ERROR_UNSUPPORTED, and `lp_present` does without rapid
+// updates. Pass an `LPCapabilityCache` to remember the reply for each
+// device name, so that opening the device again does not wait for it.
+//
+// RGB models
+// ----------
+//
+// The Launchpad MK2 and Pro have RGB LEDs set with sysex messages. When
+// `lp_open_ex` probes one of them, the same functions keep working: the
+// red and green levels of the colors are mapped to RGB, and the LEDs
+// set by each call, like a whole frame from `lp_set_frame`, are sent
+// as a single message. Features of the Launchpad S that these models
+// lack, like double buffering, return LP_ERROR_UNSUPPORTED. Each
+// model has its own map of the LEDs and buttons: the Pro has the
+// Automap row above the grid, and its round buttons send control
+// changes, of which only the Automap row and the scene launch
+// column are reported as events.
 //
 // Colors
 // ------
@@ -93,6 +131,213 @@
 // improvement that is commonly seen videogames. This library provides
 // the function `lp_swap_buffers` to, guess what, swap the buffers.
 //
+// `lp_begin_frame` and `lp_end_frame` manage the buffers for you: the
+// frame is drawn in the buffer that is not displayed, starting from
+// what is displayed, and then displayed at once without tearing. The
+// library knows what each buffer holds, so it copies the displayed
+// buffer only when needed and `lp_present` sends only the LEDs that
+// change.
+//
+// Text scrolling
+// --------------
+//
+// The device can scroll a text across the grid by itself: a call to
+// `lp_scroll_text` sends a few bytes and `lp_check_event` reports an
+// LP_EVENT_TEXT_SCROLLED event when the text is over.
+//
+// Dimming
+// -------
+//
+// The brightness of all the LEDs depends on the duty cycle of the
+// device, set with `lp_set_duty_cycle`. `lp_set_dimmer` picks the duty
+// cycle closest to a level from 0 to 1, so fading the whole surface
+// takes a single message per step instead of setting every LED again.
+//
+// Blinking
+// --------
+//
+// The device can flash LEDs by itself, displaying one buffer and then
+// the other. `lp_set_blinking` uses it to make an LED blink between
+// two colors, which then costs no message at all until it changes.
+// The buffers are made equal before flashing starts, so that only
+// that LED blinks.
+// While flashing, the other LEDs must be set with LP_COLOR_FLAG_COPY
+// to be the same in both buffers, or they blink too.
+//
+// Pages
+// -----
+//
+// Layouts with many pages can register each page once with
+// `lp_add_page`, and update its LEDs with `lp_set_page_led`. The
+// library keeps the messages of every page encoded, so that
+// `lp_show_page` shows a page with a single burst of rapid updates,
+// drawn in the buffer that is not displayed and then displayed at
+// once. The page shown before stays in the other buffer, so going
+// back to it only takes a buffer swap. Drawing with the other
+// functions while a page is shown draws over it.
+//
+// Command buffers
+// ---------------
+//
+// Sequences that are shown over and over, like idle animations or
+// state indicators, can be recorded once in an `LPCommandBuffer`:
+// between `lp_begin_record` and `lp_end_record`, the messages of the
+// functions called are stored in the command buffer instead of being
+// written. `lp_replay` then writes all of them at once, without
+// encoding them again, so a recording holds at most
+// LIBLAUNCHPAD_OUT_BUFFER_SIZE bytes. Functions that depend on what
+// the device shows record the messages for what it shows while
+// recording, so `lp_present` records a full frame.
+//
+// Encoding
+// --------
+//
+// The `lp_encode_*` functions write the bytes of a message at the
+// start of a buffer provided by the caller and return how many they
+// wrote, without allocating nor writing to the device. They are what
+// the other functions use to build their messages, and can be used
+// to batch messages or send them some other way.
+//
+// Running status
+// --------------
+//
+// Consecutive note messages are sent with MIDI running status: the
+// status byte is sent only when it differs from the one of the
+// previous note message, which saves a third of the bytes when
+// setting many notes. Any other message, like the control changes
+// used for resetting or double buffering, carries its status byte.
+//
+// Batching
+// --------
+//
+// By default every function writes its messages and waits for them to
+// be sent. Between `lp_begin_batch` and `lp_flush` the messages are
+// instead collected by the library and written to the device all at
+// once, and waiting for them to be sent is up to the caller.
+//
+// Coalescing
+// ----------
+//
+// Setting a few notes at a time still costs a write and a USB packet
+// per call. With a coalescing window set by `lp_set_coalescing`, the
+// notes set with `lp_set_note` are held for that many microseconds
+// after the first one: a note set again replaces the one held for the
+// same key, and all of them are written at once when the window
+// closes. The writer thread closes the window when it expires.
+// Without it, the window is closed by the first call to the library
+// after it expired, like `lp_pace`, or right away by any other message
+// written, and `lp_check_event` writes the notes held before waiting
+// for an event with blocking reads.
+//
+// Writer thread
+// -------------
+//
+// Writing to the device blocks until the bytes are accepted by the
+// driver. If LIBLAUNCHPAD_THREADED is defined, opening the device
+// with `lp_open_ex` and the threaded option starts a thread that
+// does the writing: all the functions only queue their messages in a
+// lock-free ring and return right away. `lp_flush` waits until the
+// thread has written everything queued so far.
+//
+// Non-blocking output
+// -------------------
+//
+// Reading and writing can be made non-blocking separately with the
+// options of `lp_open_ex`. When writing is non-blocking, the bytes
+// the device cannot take right away are kept by the library and the
+// functions that write return LP_PENDING instead of LP_OK. Call
+// `lp_resume` when the descriptors from `lp_output_descriptors` are
+// writable to send the rest, starting from the exact byte where the
+// device stopped. If the library has no room left for a message, the
+// function returns LP_ERROR_WOULD_BLOCK without writing anything and
+// can be called again after `lp_resume`.
+//
+// MIDI parameters
+// ---------------
+//
+// The driver queues the bytes written in a buffer of its own, and
+// messages written while it is full wait behind everything already in
+// it. The params of the options of `lp_open_ex` set the size of the
+// input and output buffers, how much room the output needs to be
+// writable and whether active sensing is sent on close, trading queue
+// depth against latency. `lp_get_midi_params` returns the values in
+// use, as the driver may adjust them.
+//
+// Transports
+// ----------
+//
+// `lp_open_ex` talks to the device through ALSA rawmidi. Anything else
+// that carries MIDI bytes, like a network socket, a mock recording what
+// is written for tests, or a benchmark without a device, can be used
+// with `lp_open_transport` by filling an `LPTransport` with functions
+// to write, read, get the descriptors to poll, set non-blocking mode,
+// flush and close. Encoding, parsing and the output pipeline stay the
+// same. The MIDI parameters only apply to ALSA.
+//
+// Frame pacing
+// ------------
+//
+// The library measures how fast the device absorbs what is written,
+// and `lp_frame_interval` recommends how long a frame should last for
+// the device to keep up. Calling `lp_pace` once per frame waits for
+// the next frame, so the frame rate follows the available bandwidth.
+//
+// Priorities
+// ----------
+//
+// Messages are written with a priority set by `lp_set_priority`:
+// interactive, normal or bulk. Interactive messages, like lighting a
+// pressed pad, are sent ahead of normal and bulk messages still
+// waiting in a batch or for the writer thread, which writes bulk
+// messages a chunk at a time to let urgent ones through.
+//
+// Latest frame
+// ------------
+//
+// When frames are produced faster than the device can absorb them,
+// they pile up in the output and what is displayed falls behind. A
+// frame submitted with `lp_submit_frame` instead replaces any frame
+// submitted before that did not start being sent yet, so the device
+// always shows the latest one.
+//
+// Frame cache
+// -----------
+//
+// Animations often show again frames they already showed. If
+// LIBLAUNCHPAD_FRAME_CACHE is defined, the library keeps the messages
+// of the last LIBLAUNCHPAD_FRAME_CACHE_SIZE frames it encoded, looked
+// up by a hash of the frame, and copies them instead of encoding a
+// frame found there. `lp_frame_cache_stats` counts how many frames
+// were found, to choose the size of the cache.
+//
+// Shadow buffers
+// --------------
+//
+// The library keeps track of the colors in both buffers of the
+// device from the messages it sends. `lp_present` takes a full frame
+// and sends only the LEDs that changed since what was last sent, so
+// drawing a whole frame every time costs as much as its changes. The
+// colors are known after `lp_reset` or after all of them were set.
+//
+// Rapid update
+// ------------
+//
+// Setting notes one by one costs a 3 bytes message per LED. The
+// Launchpad S also accepts rapid update messages, which set two LEDs
+// at a time walking through the grid, the scene launch buttons and
+// the Automap buttons. Use `lp_set_frame` to update all the 80 LEDs
+// of the device in one go with 84 bytes, while `lp_set_notes` needs
+// 129 bytes for the grid alone.
+//
+// Filling
+// -------
+//
+// `lp_fill` sets every LED to one color and `lp_clear_region` turns off
+// a rectangle of the grid, each with the cheapest messages: the notes
+// that change, a rapid update, or a single 3 bytes reset or test
+// command when the whole surface ends up off or yellow and nothing
+// else would show it.
+//
 // Input
 // -----
 //
@@ -129,6 +374,11 @@
 //   #define LIBLAUNCHPAD_IMPLEMENTATION
 //   #include "liblaunchpad.h"
 //
+// The implementation uses clock_gettime and nanosleep, so it needs
+// _POSIX_C_SOURCE to be at least 199309L when compiling as C99. It is
+// defined by the library when the implementation is the first thing
+// included, otherwise define it before including any system header.
+//
 //
 // Code
 // ====
@@ -161,9 +411,145 @@ extern "C" {
 #ifndef LIBLAUNCHPAD_DEF
   #define LIBLAUNCHPAD_DEF extern
 #endif
+
+// Config: Size in bytes of the output buffer, where the messages of
+// a batch are collected before being written to the device
+#ifndef LIBLAUNCHPAD_OUT_BUFFER_SIZE
+  #define LIBLAUNCHPAD_OUT_BUFFER_SIZE 1024
+#endif
+
+// Config: Microseconds during which the notes set with `lp_set_note`
+//         are coalesced before being written, 0 to write them right
+//         away. Can be changed with `lp_set_coalescing`.
+#ifndef LIBLAUNCHPAD_COALESCE_WINDOW
+  #define LIBLAUNCHPAD_COALESCE_WINDOW 0
+#endif
+
+// Config: Interval in seconds between frames recommended by
+//         `lp_frame_interval` before the output throughput is known,
+//         and the bounds of the recommended interval
+#ifndef LIBLAUNCHPAD_FRAME_INTERVAL
+  #define LIBLAUNCHPAD_FRAME_INTERVAL (1.0 / 30.0)
+#endif
+#ifndef LIBLAUNCHPAD_FRAME_INTERVAL_MIN
+  #define LIBLAUNCHPAD_FRAME_INTERVAL_MIN (1.0 / 120.0)
+#endif
+#ifndef LIBLAUNCHPAD_FRAME_INTERVAL_MAX
+  #define LIBLAUNCHPAD_FRAME_INTERVAL_MAX (1.0 / 4.0)
+#endif
+
+// Config: How much longer than the time the device needs to absorb a
+//         frame the recommended frame interval is
+#ifndef LIBLAUNCHPAD_FRAME_HEADROOM
+  #define LIBLAUNCHPAD_FRAME_HEADROOM 1.25
+#endif
+
+// Config: Bytes written at a time from the lanes below interactive
+//         priority, before checking for more urgent messages
+#ifndef LIBLAUNCHPAD_LANE_CHUNK
+  #define LIBLAUNCHPAD_LANE_CHUNK 96
+#endif
+
+// Config: Enable the writer thread by defining LIBLAUNCHPAD_THREADED,
+//         then open the device with `lp_open_ex` and the threaded
+//         option. You need to link with -lpthread.
+//
+// Note: Disabled by default
+#if 0
+  #define LIBLAUNCHPAD_THREADED
+#endif
+
+// Config: Maximum length of the text scrolled by `lp_scroll_text`
+#ifndef LIBLAUNCHPAD_TEXT_SIZE
+  #define LIBLAUNCHPAD_TEXT_SIZE 256
+#endif
+
+// Config: Milliseconds to wait for the reply to the device inquiry
+#ifndef LIBLAUNCHPAD_PROBE_TIMEOUT
+  #define LIBLAUNCHPAD_PROBE_TIMEOUT 250
+#endif
+
+// Config: Number of devices remembered by an `LPCapabilityCache`
+#ifndef LIBLAUNCHPAD_CAPABILITY_CACHE_SIZE
+  #define LIBLAUNCHPAD_CAPABILITY_CACHE_SIZE 8
+#endif
+
+// Config: Maximum length of the device names remembered by an
+// `LPCapabilityCache`, longer names are not cached
+#ifndef LIBLAUNCHPAD_DEVICE_NAME_SIZE
+  #define LIBLAUNCHPAD_DEVICE_NAME_SIZE 64
+#endif
+
+// Config: Maximum number of pages, see `lp_add_page`
+#ifndef LIBLAUNCHPAD_PAGES
+  #define LIBLAUNCHPAD_PAGES 8
+#endif
+
+// Config: Size in bytes of the name of a page, including the
+//         terminating null byte
+#ifndef LIBLAUNCHPAD_PAGE_NAME_SIZE
+  #define LIBLAUNCHPAD_PAGE_NAME_SIZE 16
+#endif
+
+// Config: Enable a cache of the last frames encoded by defining
+//         LIBLAUNCHPAD_FRAME_CACHE, so that frames shown again are
+//         not encoded again, see `lp_frame_cache_stats`
+//
+// Note: Disabled by default
+#if 0
+  #define LIBLAUNCHPAD_FRAME_CACHE
+#endif
+
+// Config: Number of frames kept in the frame cache
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+#ifndef LIBLAUNCHPAD_FRAME_CACHE_SIZE
+  #define LIBLAUNCHPAD_FRAME_CACHE_SIZE 16
+#endif
+#endif
+
+// Config: Size in bytes of the ring where messages are queued for
+//         the writer thread, must be a power of two
+#ifdef LIBLAUNCHPAD_THREADED
+#ifndef LIBLAUNCHPAD_RING_SIZE
+  #define LIBLAUNCHPAD_RING_SIZE 4096
+#endif
+#endif
+
+// Config: Longest sleep in microseconds of the writer thread while
+//         notes are held in the coalescing window, messages written
+//         meanwhile may wait up to that long
+#ifdef LIBLAUNCHPAD_THREADED
+#ifndef LIBLAUNCHPAD_WRITER_SLICE
+  #define LIBLAUNCHPAD_WRITER_SLICE 100
+#endif
+#endif
   
+// The implementation uses clock_gettime and nanosleep, which strict
+// C99 hides unless a feature test macro asks for POSIX.1b
+#if defined(LIBLAUNCHPAD_IMPLEMENTATION) && defined(__STRICT_ANSI__) \
+    && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE) \
+    && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+  #define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <alsa/asoundlib.h>
 #include <stdbool.h>
+#include <time.h>
+
+#if defined(LIBLAUNCHPAD_IMPLEMENTATION) && !defined(CLOCK_MONOTONIC)
+  #error "liblaunchpad.h: define _POSIX_C_SOURCE to at least 199309L \
+before including any system header"
+#endif
+
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+  #include <stdint.h>
+#endif
+
+#ifdef LIBLAUNCHPAD_THREADED
+  #include <pthread.h>
+  #include <semaphore.h>
+  #include <sched.h>
+#endif
 
 // Errors
 #define LP_OK                       0
@@ -175,11 +561,36 @@ extern "C" {
 #define LP_ERROR_MIDI_CLOSE        -6
 #define LP_ERROR_ARGUMENT_NULL     -7
 #define LP_ERROR_MIDI_READ         -8
+#define LP_ERROR_UNSUPPORTED       -9
+#define LP_ERROR_THREAD            -10
+#define LP_ERROR_WOULD_BLOCK       -11
+#define LP_ERROR_MIDI_PARAMS       -12
+#define LP_ERROR_BUFFER_FULL       -13
+#define LP_ERROR_PAGES_FULL        -14
+#define LP_ERROR_NO_PAGE           -15
+#define LP_ERROR_NAME_TOO_LONG     -16
+
+// Returned instead of LP_OK by the functions that write when the
+// output is non-blocking and some bytes are still waiting to be sent,
+// see `lp_resume`
+#define LP_PENDING                  1
 
 // Main grid's rows and columns
 #define LP_ROWS 8
 #define LP_COLS 8
 
+// Number of LEDs on the device: the 8x8 grid, the 8 scene launch
+// buttons on the right column and the 8 Automap buttons on the top row
+#define LP_LEDS 80
+
+// Index of an LED in a frame of LP_LEDS colors. Frames follow the
+// order used by the device for rapid updates: the grid row by row,
+// then the scene launch buttons from top to bottom, then the Automap
+// buttons from left to right.
+#define LP_FRAME_GRID(row, col) ((LP_COLS * (row)) + (col))
+#define LP_FRAME_SCENE(row)     ((LP_ROWS * LP_COLS) + (row))
+#define LP_FRAME_AUTOMAP(col)   ((LP_ROWS * LP_COLS) + LP_ROWS + (col))
+
 // Notes can be either ON or OFF
 typedef unsigned char LPNoteState;
 enum {
@@ -187,20 +598,54 @@ enum {
   LP_NOTE_OFF = 0x80,
 };
 
+// Status of a rapid update message, which sets the next two LEDs
+// of a frame
+#define LP_RAPID_UPDATE 0x92
+// Size in bytes of the messages that set a full frame with rapid
+// updates, including the message that rewinds the device cursor
+#define LP_FRAME_MESSAGE_SIZE (3 + 3 * LP_LEDS / 2)
+// Size in bytes of every other message
+#define LP_MESSAGE_SIZE 3
+// Size in bytes of the message that scrolls a text of [length] bytes
+#define LP_TEXT_MESSAGE_SIZE(length) (8 + (length))
+// Size in bytes of the universal device inquiry message
+#define LP_INQUIRY_MESSAGE_SIZE 6
+// Size in bytes of the reply to the device inquiry
+#define LP_INQUIRY_REPLY_SIZE 17
+// Size in bytes of the message that sets [count] LEDs of an RGB model
+#define LP_RGB_MESSAGE_SIZE(count) (8 + 4 * (count))
+// Size in bytes of the message that turns off all the LEDs of an RGB
+// model
+#define LP_RGB_CLEAR_MESSAGE_SIZE 9
+
 // The NoteKey is the device index for a node
 typedef unsigned char LPNoteKey;
 // Use LP_KEY to calculate the index from [row] and [col]
 #define LP_KEY(row, col) ((0x10 * row) + col)
+// Use LP_KEY_AUTOMAP for the Automap button in column [col] of the
+// top row, which is set with a control change instead of a note
+#define LP_KEY_AUTOMAP(col) (0x80 + (col))
+// A key that is not on the device
+#define LP_KEY_NONE 0xFF
+// Number of MIDI notes, the size of the tables of the key layout
+#define LP_NOTES 128
+
+// Key layouts of the device, the keys are always given with LP_KEY
+// and the library translates them to the notes of the layout
+typedef enum {
+  LP_LAYOUT_XY        = 1,
+  LP_LAYOUT_DRUM_RACK = 2,
+} LPLayout;
 
 // The color can have some flags for specific usage
 typedef unsigned char LPNoteColor;
 typedef enum {
   // For double buffering, clear the other buffer’s copy of this LED.
-  LP_COLOR_FLAG_CLEAR = (1<<2),
+  LP_COLOR_FLAG_CLEAR = (1<<3),
   // For double buffering, write this LED data to both buffers.
   // Note: this behavior overrides the Clear behavior
   // when both bits are set
-  LP_COLOR_FLAG_COPY  = (1<<3),
+  LP_COLOR_FLAG_COPY  = (1<<2),
 } LPNoteColorFlags;
 
 // Brightness level for the color greed or red
@@ -212,6 +657,11 @@ typedef enum {
 } LPNoteBrightness;
 // Use this to define a color
 #define LP_COLOR(green, red, flags) ((0x10 * green) + red + flags)
+// Bits of a color that hold the brightness of green and red
+#define LP_COLOR_MASK LP_COLOR(LP_BRIGHTNESS_FULL, LP_BRIGHTNESS_FULL, 0)
+// Color of an LED that is not known by the library, for example
+// before the device is reset
+#define LP_COLOR_UNKNOWN 0xFF
 
 // Some predefined colors
 #define LP_COLOR_RED_LOW LP_COLOR(LP_BRIGHTNESS_OFF, LP_BRIGHTNESS_LOW, 0)
@@ -240,6 +690,8 @@ typedef enum {
   LP_EVENT_RELEASED         = 2,
   LP_EVENT_AUTOMAP_PRESSED  = 3,
   LP_EVENT_AUTOMAP_RELEASED = 4,
+  // A text scrolled by `lp_scroll_text` finished scrolling
+  LP_EVENT_TEXT_SCROLLED    = 5,
 } LPEventType;
 
 // An event
@@ -283,14 +735,349 @@ enum {
   LP_DOUBLE_BUFFERING_COPY    = (1<<4),
 };
 
-// Launchpad S context
+// Priority of the messages written, see `lp_set_priority`
+typedef enum {
+  // Feedback to the user, like lighting a pressed pad
+  LP_PRIORITY_INTERACTIVE = 0,
+  // Everything else, the default
+  LP_PRIORITY_NORMAL      = 1,
+  // Large updates like full frames of an animation
+  LP_PRIORITY_BULK        = 2,
+} LPPriority;
+// Number of priorities, each one has its own lane
+#define LP_PRIORITIES 3
+
+// Parameters of the MIDI streams of the driver. Zero values keep the
+// defaults of the driver.
+typedef struct {
+  // Size in bytes of the output buffer of the driver, a smaller one
+  // queues less messages ahead of new ones
+  size_t out_buffer_size;
+  // Free bytes in the output buffer of the driver needed for the
+  // output to be writable, see `lp_output_descriptors`
+  size_t out_avail_min;
+  // Size in bytes of the input buffer of the driver
+  size_t in_buffer_size;
+  // Whether closing the output does not send active sensing
+  bool no_active_sensing;
+} LPMidiParams;
+
+// Models of Launchpad, as told by the reply to the device inquiry
+typedef enum {
+  // Not probed, or not a known model, assumed to be a Launchpad S
+  LP_MODEL_UNKNOWN        = 0,
+  // The original Launchpad, which does not reply to the inquiry
+  LP_MODEL_LAUNCHPAD      = 1,
+  LP_MODEL_LAUNCHPAD_S    = 2,
+  LP_MODEL_LAUNCHPAD_MINI = 3,
+  // Models with RGB LEDs
+  LP_MODEL_LAUNCHPAD_MK2  = 4,
+  LP_MODEL_LAUNCHPAD_PRO  = 5,
+} LPModel;
+
+// Features that are not on every model
+typedef unsigned int LPCapabilityFlag;
+enum {
+  // Rapid update messages, needed by `lp_set_frame`, `lp_submit_frame`
+  // and `lp_show_page`
+  LP_CAPABILITY_RAPID_UPDATE     = (1<<0),
+  // Flashing, needed by `lp_enable_flashing` and `lp_set_blinking`
+  LP_CAPABILITY_FLASHING         = (1<<1),
+  // Text scrolling, needed by `lp_scroll_text`
+  LP_CAPABILITY_TEXT             = (1<<2),
+  // Double buffering, needed by `lp_set_double_buffering_flags`,
+  // `lp_swap_buffers`, `lp_begin_frame`, `lp_end_frame` and
+  // `lp_show_page`
+  LP_CAPABILITY_DOUBLE_BUFFERING = (1<<3),
+  // Duty cycle control, needed by `lp_set_duty_cycle` and
+  // `lp_set_dimmer`
+  LP_CAPABILITY_DUTY_CYCLE       = (1<<4),
+  // RGB LEDs set with sysex messages, the colors of the Launchpad S
+  // are mapped to RGB and frames are sent as a single message
+  LP_CAPABILITY_RGB              = (1<<5),
+};
+// The capabilities of the Launchpad S
+#define LP_CAPABILITIES_LAUNCHPAD_S (LP_CAPABILITY_RAPID_UPDATE \
+                                     | LP_CAPABILITY_FLASHING \
+                                     | LP_CAPABILITY_TEXT \
+                                     | LP_CAPABILITY_DOUBLE_BUFFERING \
+                                     | LP_CAPABILITY_DUTY_CYCLE)
+
+// What the device is and what it can do
+typedef struct {
+  LPModel model;
+  // Firmware version from the reply to the inquiry, 0 if unknown
+  unsigned int firmware;
+  LPCapabilityFlag flags;
+} LPCapabilities;
+
+// Capabilities probed for each device name, so that opening the same
+// device again does not wait for the reply to the inquiry, see
+// `lp_capability_cache_init`
+typedef struct {
+  struct {
+    bool used;
+    char devicename[LIBLAUNCHPAD_DEVICE_NAME_SIZE];
+    LPCapabilities capabilities;
+  } entries[LIBLAUNCHPAD_CAPABILITY_CACHE_SIZE];
+  // Next entry to replace when the cache is full
+  int next;
+} LPCapabilityCache;
+
+// Carries the bytes to and from the device, see `lp_open_transport`.
+// Every function is called with the context given when opening.
+typedef struct {
+  // Write up to [size] bytes from [buff].
+  // Returns the number of bytes written, -EAGAIN if writing is
+  // non-blocking and nothing could be written, or a negative errno.
+  ssize_t (*write)(void *context, const unsigned char *buff, size_t size);
+  // Read up to [size] bytes into [buff].
+  // Returns the number of bytes read, -EAGAIN if reading is
+  // non-blocking and there is nothing to read, or a negative errno.
+  ssize_t (*read)(void *context, unsigned char *buff, size_t size);
+  // Fill [pfds] with at most [space] descriptors to poll to know when
+  // the output can be written if [output] is true, or when there is
+  // something to read otherwise.
+  // Returns the number of descriptors filled or a negative errno.
+  int (*poll_descriptors)(void *context, bool output,
+                          struct pollfd *pfds, unsigned int space);
+  // Make writing if [output] is true, or reading otherwise, return
+  // -EAGAIN instead of blocking when [nonblocking] is true.
+  // Returns 0 or a negative errno.
+  int (*set_nonblocking)(void *context, bool output, bool nonblocking);
+  // Wait until all the bytes written have been sent to the device.
+  // Returns 0 or a negative errno.
+  int (*flush)(void *context);
+  // Returns the number of bytes written but not yet sent to the
+  // device, or 0 if it cannot be known. Can be NULL.
+  size_t (*queued)(void *context);
+  // Release the transport, called once by `lp_close`.
+  // Returns 0 or a negative errno.
+  int (*close)(void *context);
+} LPTransport;
+
+// Context of the ALSA rawmidi transport used by `lp_open_ex`
 typedef struct {
   // Reading channel
   snd_rawmidi_t *midi_in;
   // Writing channel
   snd_rawmidi_t *midi_out;
+  // Size in bytes of the output buffer of the driver, or 0 if unknown
+  size_t out_buffer_size;
+} LPAlsaTransport;
+
+// Options for `lp_open_ex` and `lp_open_transport`
+typedef struct {
+  // Whether reading events is non-blocking
+  bool nonblocking;
+  // Whether writing messages is non-blocking, ignored by the writer
+  // thread
+  bool nonblocking_output;
+  // Whether messages are written to the device by a dedicated thread,
+  // needs LIBLAUNCHPAD_THREADED
+  bool threaded;
+  // Parameters of the MIDI streams, ignored by `lp_open_transport`
+  LPMidiParams params;
+  // Key layout of the device, ignored by RGB models
+  LPLayout layout;
+  // Whether the device is asked what it is when opened, waiting up to
+  // LIBLAUNCHPAD_PROBE_TIMEOUT milliseconds for the reply. Otherwise
+  // it is assumed to be a Launchpad S.
+  bool probe;
+  // Cache of the capabilities probed, or NULL. Must outlive the call.
+  LPCapabilityCache *capability_cache;
+} LPOptions;
+// The options used by `lp_open`
+#define LP_OPTIONS_DEFAULT (LPOptions){ .nonblocking = false, \
+                                        .nonblocking_output = false, \
+                                        .threaded = false, \
+                                        .params = { 0, 0, 0, false }, \
+                                        .layout = LP_LAYOUT_XY, \
+                                        .probe = false, \
+                                        .capability_cache = NULL }
+
+// Messages recorded once and replayed with `lp_replay`, see
+// `lp_command_buffer_init`
+typedef struct {
+  // Storage of the recorded messages, provided by the caller
+  unsigned char *buff;
+  // Size in bytes of buff
+  size_t capacity;
+  // Number of bytes recorded in buff
+  size_t size;
+} LPCommandBuffer;
+
+// A page of LEDs, see `lp_add_page`
+typedef struct {
+  // Whether the page is registered
+  bool used;
+  // Null terminated name of the page
+  char name[LIBLAUNCHPAD_PAGE_NAME_SIZE];
+  // Colors of the LEDs, without flags
+  LPNoteColor frame[LP_LEDS];
+  // The messages encoded by `lp_encode_frame` for frame
+  unsigned char encoded[LP_FRAME_MESSAGE_SIZE];
+} LPPage;
+
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+
+// A frame in the frame cache, with its messages
+typedef struct {
+  // Hash of frame, see `_lp_frame_hash`
+  uint32_t hash;
+  // When the entry was last used, from the use counter of the cache,
+  // or 0 if the entry is empty
+  unsigned long last_use;
+  LPNoteColor frame[LP_LEDS];
+  // The messages encoded by `lp_encode_frame`
+  unsigned char encoded[LP_FRAME_MESSAGE_SIZE];
+} LPFrameCacheEntry;
+
+#endif // LIBLAUNCHPAD_FRAME_CACHE
+
+#ifdef LIBLAUNCHPAD_THREADED
+
+// Single producer single consumer ring of bytes. The head is only
+// written by the producer and the tail only by the consumer, both
+// only grow and are wrapped around the size of the ring when used as
+// indexes.
+typedef struct {
+  unsigned char buff[LIBLAUNCHPAD_RING_SIZE];
+  size_t head;
+  size_t tail;
+} LPRing;
+
+#endif // LIBLAUNCHPAD_THREADED
+
+// Launchpad S context
+typedef struct {
+  // Carries the bytes to and from the device, NULL until opened
+  const LPTransport *transport;
+  // Passed to every function of transport
+  void *transport_context;
+  // Context of the ALSA transport when opened with `lp_open_ex`
+  LPAlsaTransport alsa;
   // Current buffer displayed, either 0 or 1
   int current_buff;
+  // Last note status byte sent to the device, or 0 if the next message
+  // must carry its status byte
+  unsigned char running_status;
+  // Messages not yet written to the transport, one lane per priority
+  unsigned char out_buff[LP_PRIORITIES][LIBLAUNCHPAD_OUT_BUFFER_SIZE];
+  // Number of bytes in each lane of out_buff
+  size_t out_size[LP_PRIORITIES];
+  // Whether a batch was started with `lp_begin_batch`
+  bool batching;
+  // Whether writing to the transport is non-blocking
+  bool nonblocking_output;
+  // Whether reading from the transport is non-blocking
+  bool nonblocking_input;
+  // Bytes the device did not take yet with non-blocking output, ready
+  // to be written as they are
+  unsigned char unsent[LIBLAUNCHPAD_OUT_BUFFER_SIZE];
+  // Number of bytes in unsent, 0 if nothing is waiting
+  size_t unsent_size;
+  // Bytes of unsent already written
+  size_t unsent_offset;
+  // Priority of the messages being written
+  LPPriority priority;
+  // Command buffer recording the messages written instead of the
+  // device, or NULL
+  LPCommandBuffer *recording;
+  // Buffer updated by LED messages, either 0 or 1
+  int update_buff;
+  // Colors of the LEDs in both buffers of the device, tracked from
+  // the messages sent. Either a color without flags or
+  // LP_COLOR_UNKNOWN.
+  LPNoteColor shadow[2][LP_LEDS];
+  // Next LED set by a rapid update message
+  int rapid_cursor;
+  // What the device is and what it can do
+  LPCapabilities capabilities;
+  // Key layout of the device
+  LPLayout layout;
+  // Note of the device for each key, and key of each note of the
+  // device or LP_KEY_NONE, in the layout
+  LPNoteKey layout_notes[LP_NOTES];
+  LPNoteKey layout_keys[LP_NOTES];
+  // Whether the device is flashing, swapping the displayed buffer
+  bool flashing;
+  // Duty cycle of the LEDs, 0 / 0 if unknown
+  unsigned char duty_numerator;
+  unsigned char duty_denominator;
+  // Rapid update of the latest frame submitted with `lp_submit_frame`
+  // and not sent yet
+  unsigned char mailbox[LP_FRAME_MESSAGE_SIZE];
+  size_t mailbox_size;
+  // Lane of the frame in the mailbox, the priority it was submitted with
+  LPPriority mailbox_priority;
+  // Whether the mailbox holds a frame
+  bool mailbox_full;
+  // Pages registered with `lp_add_page`
+  LPPage pages[LIBLAUNCHPAD_PAGES];
+  // Page shown last by `lp_show_page`, or -1
+  int active_page;
+  // Parameters of the MIDI streams in use, 0 where unknown
+  LPMidiParams params;
+  // Estimated bytes per second absorbed by the device, 0 until
+  // measured
+  size_t out_rate;
+  // Start of the current throughput measurement
+  struct timespec rate_time;
+  // Bytes waiting in the driver at rate_time
+  size_t rate_queued;
+  // Bytes written to the driver since rate_time
+  size_t rate_sent;
+  // Average bytes written per frame, between calls to `lp_pace`
+  size_t frame_bytes;
+  // Bytes written since the last call to `lp_pace`
+  size_t pace_bytes;
+  // When the last frame was paced by `lp_pace`
+  struct timespec pace_time;
+  // Microseconds during which notes are coalesced, 0 if disabled
+  unsigned int coalesce_window;
+  // Colors of the notes held in the coalescing window, by index in a
+  // frame, or LP_COLOR_UNKNOWN for the notes not held
+  LPNoteColor coalesced[LP_LEDS];
+  // Number of notes held in the coalescing window
+  int coalesced_count;
+  // When the coalescing window opened
+  struct timespec coalesce_time;
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+  // Frames encoded last, the least recently used is replaced first
+  LPFrameCacheEntry frame_cache[LIBLAUNCHPAD_FRAME_CACHE_SIZE];
+  // Use counter of the frame cache, grows at every use
+  unsigned long frame_cache_clock;
+  // Number of frames found in the frame cache
+  size_t frame_cache_hits;
+  // Number of frames not found in the frame cache
+  size_t frame_cache_misses;
+#endif
+#ifdef LIBLAUNCHPAD_THREADED
+  // Whether messages are written by the writer thread
+  bool threaded;
+  // Writes the messages queued in the rings to the transport
+  pthread_t writer;
+  // Messages queued for the writer thread, one ring per priority
+  LPRing rings[LP_PRIORITIES];
+  // Posted to wake up the writer thread
+  sem_t writer_sem;
+  // Posted by the writer thread when a flush completed
+  sem_t flush_sem;
+  // Position in each ring that a pending flush waits for
+  size_t flush_target[LP_PRIORITIES];
+  // Whether the pending flush also drains the transport
+  bool flush_drain;
+  // Whether a flush is waiting for the writer thread
+  bool flush_pending;
+  // Set to stop the writer thread
+  bool writer_stop;
+  // Last error of the writer thread, or LP_OK
+  int writer_error;
+  // Protects the mailbox and the notes held in the coalescing window
+  // from the writer thread
+  pthread_mutex_t mailbox_lock;
+#endif
 } LP;
 
 //
@@ -303,11 +1090,45 @@ typedef struct {
 // Note: Remember to call `lp_close` when you are done.
 LIBLAUNCHPAD_DEF int lp_open(LP *lp, char* devicename, bool nonblocking);
 
+// Open a device with name [devicename] and the specified [options]
+// Returns either LP_OK or a negative LP_ERROR.
+// Note: Remember to call `lp_close` when you are done.
+LIBLAUNCHPAD_DEF int
+lp_open_ex(LP *lp, char* devicename, const LPOptions *options);
+
+// Open a device reached through [transport] with the specified
+// [options], passing [context] to every function of [transport].
+// The capabilities probed are not cached.
+// Returns either LP_OK or a negative LP_ERROR. Errors other than
+// LP_ERROR_LP_NULL, LP_ERROR_ARGUMENT_NULL and LP_ERROR_UNSUPPORTED
+// leave [transport] closed.
+// Note: Remember to call `lp_close` when you are done, which closes
+//       [transport].
+LIBLAUNCHPAD_DEF int lp_open_transport(LP *lp, const LPTransport *transport,
+                                       void *context,
+                                       const LPOptions *options);
+
+// Set [capabilities] to what the device is and what it can do
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_get_capabilities(LP *lp,
+                                         LPCapabilities *capabilities);
+
+// Initialize [cache] to remember no device
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_capability_cache_init(LPCapabilityCache *cache);
+
+// Set [params] to the parameters of the MIDI streams in use, which may
+// differ from the ones requested when opening the device
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_get_midi_params(LP *lp, LPMidiParams *params);
+
 // Reset all the notes in the Launchpad, turning the lights off
 // Returns either LP_OK or a negative LP_ERROR.
 LIBLAUNCHPAD_DEF int lp_reset(LP *lp);
 
-// Closes communication with the Launchpad
+// Closes communication with the Launchpad, after writing the messages
+// left. The writer thread is stopped and the device closed even if
+// writing fails.
 // Returns either LP_OK or a negative LP_ERROR.
 LIBLAUNCHPAD_DEF int lp_close(LP *lp);
 
@@ -319,6 +1140,65 @@ LIBLAUNCHPAD_DEF int lp_set_note(LP *lp, LPNote note);
 // Returns either LP_OK or a negative LP_ERROR.
 LIBLAUNCHPAD_DEF int lp_set_notes(LP *lp, LPNote notes[LP_ROWS * LP_COLS]);
 
+// Set the [count] [notes] anywhere on the device, including the scene
+// launch column and the Automap row, in a single write. Notes are
+// grouped so that they share status bytes, and only the last note
+// of each LED is sent.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_set_leds(LP *lp, const LPNote *notes, size_t count);
+
+// Set all the LP_LEDS LEDs on the device with [frame] colors, using
+// rapid update messages which carry two LEDs each. The frame is
+// indexed with LP_FRAME_GRID, LP_FRAME_SCENE and LP_FRAME_AUTOMAP.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_set_frame(LP *lp, LPNoteColor frame[LP_LEDS]);
+
+// Set the LEDs of the updating buffer to [frame], like `lp_set_frame`,
+// sending only the LEDs that differ from what the library knows is in
+// that buffer. The changes are sent either as note messages or as a
+// rapid update, whichever takes less bytes.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_present(LP *lp, LPNoteColor frame[LP_LEDS]);
+
+// Set all the LP_LEDS LEDs of the updating buffer to [color], like
+// `lp_present`. When the first buffer is both displayed and updated,
+// without flashing and at the default duty cycle, turning everything
+// off or yellow may take a single reset or test command instead,
+// which also clears the other buffer.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_fill(LP *lp, LPNoteColor color);
+
+// Turn off the [rows] x [cols] LEDs starting at [row], [col] in the
+// updating buffer, where column LP_COLS is the scene launch column,
+// picking the cheapest messages like `lp_fill`
+// Returns either LP_OK or a negative LP_ERROR, LP_ERROR_UNSUPPORTED if
+// the region does not fit in the grid and the scene launch column.
+LIBLAUNCHPAD_DEF int lp_clear_region(LP *lp, int row, int col,
+                                     int rows, int cols);
+
+// Submit a full [frame] to be sent as a rapid update, replacing any
+// frame submitted before that did not start being sent yet, so that
+// the device always shows the latest frame without frames piling up
+// in the output. The frame is sent right away if nothing is waiting
+// to be sent, else it is sent by the writer thread as soon as the
+// device absorbed what came before, or by `lp_pace` or the next call
+// that writes to the device.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_submit_frame(LP *lp, LPNoteColor frame[LP_LEDS]);
+
+// Returns the interval in seconds recommended between frames, so that
+// the device can absorb the bytes written for each frame. The
+// throughput of the output is measured while writing, until then
+// LIBLAUNCHPAD_FRAME_INTERVAL is returned.
+LIBLAUNCHPAD_DEF double lp_frame_interval(LP *lp);
+
+// Call once per frame to wait until the next frame should be drawn,
+// following `lp_frame_interval` and giving the device time to absorb
+// what is still waiting to be sent. A frame from `lp_submit_frame`
+// still waiting is sent once the device has absorbed the rest.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_pace(LP *lp);
+
 // Low level control over double buffering, set [flags] on the device
 // Returns either LP_OK or a negative LP_ERROR.
 LIBLAUNCHPAD_DEF int
@@ -327,12 +1207,25 @@ lp_set_double_buffering_flags(LP *lp, LPDoubleBufferingFlag flags);
 // Swap buffers on the device
 LIBLAUNCHPAD_DEF int lp_swap_buffers(LP *lp);
 
+// Start drawing a frame in the buffer that is not displayed, starting
+// from what is displayed. The buffer is copied only if it is not
+// known to hold the same LEDs already, and `lp_present` then sends
+// only the LEDs that change. Call `lp_end_frame` to display it.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_begin_frame(LP *lp);
+
+// Display the frame drawn since `lp_begin_frame`, all at once
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_end_frame(LP *lp);
+
 // Check if an event occurred, setting [event]
 // If nonblocking was not set in `lp_open`, this function will block
 // until an event or an error happened. Returns 1 in case or an event,
 // or an LP_ERROR otherwise.
 // If nonblocking was specified in `lp_open`, this function will not
 // block and return 0 if no event happened.
+// Notes and control changes that are not on a key of the device are
+// skipped, returning 0.
 LIBLAUNCHPAD_DEF int lp_check_event(LP *lp, LPEvent *event);
 
 // Enable flashing, which will repeatedly swap buffers at a default speed
@@ -340,189 +1233,2978 @@ LIBLAUNCHPAD_DEF int lp_enable_flashing(LP *lp);
 
 // Disable fleshing, if enabled
 LIBLAUNCHPAD_DEF int lp_disable_flashing(LP *lp);
-  
-//
-// Implementation
-//
 
-#ifdef LIBLAUNCHPAD_IMPLEMENTATION
+// Scroll [text] across the grid in [color], at [speed] from 1 to 7,
+// or the default speed if 0. The device scrolls the text by itself,
+// and reports the end with an LP_EVENT_TEXT_SCROLLED event unless
+// [loop] is true, in which case the text scrolls until another one
+// is sent. An empty text stops scrolling. Characters that are not
+// ASCII are shown as '?'.
+// The LEDs of the grid become unknown to `lp_present`.
+// Returns either LP_OK or a negative LP_ERROR, LP_ERROR_UNSUPPORTED
+// if [speed] is out of range or [text] is longer than
+// LIBLAUNCHPAD_TEXT_SIZE.
+LIBLAUNCHPAD_DEF int lp_scroll_text(LP *lp, const char *text,
+                                    LPNoteColor color, unsigned char speed,
+                                    bool loop);
 
-LIBLAUNCHPAD_DEF int lp_open(LP *lp, char *devicename, bool nonblocking)
-{
-  if (!lp) return LP_ERROR_LP_NULL;
-  int flags = 0;
-  if (nonblocking) flags |= SND_RAWMIDI_NONBLOCK;
-  if (snd_rawmidi_open(&lp->midi_in, &lp->midi_out, devicename, flags) < 0)
-    return LP_ERROR_OPENING_LAUNCHPAD;
-  
-  return LP_OK;
-}
+// Set the duty cycle of all the LEDs to [numerator] / [denominator],
+// with [numerator] from 1 to 16 and [denominator] from 3 to 18. The
+// LEDs are brighter with higher duty cycles, the default is 1 / 5.
+// Returns either LP_OK or a negative LP_ERROR, LP_ERROR_UNSUPPORTED
+// if the duty cycle is out of range.
+LIBLAUNCHPAD_DEF int lp_set_duty_cycle(LP *lp, unsigned char numerator,
+                                       unsigned char denominator);
 
-LIBLAUNCHPAD_DEF int lp_reset(LP *lp)
-{
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_out) return LP_ERROR_UNINITIALIZED;
-  
-  unsigned char msg_buff[3] = { 0xB0, 0, 0};
-  size_t bytes = snd_rawmidi_write(lp->midi_out, msg_buff, sizeof(msg_buff));
-  if (bytes != 3) return LP_ERROR_MIDI_WRITE;
-  if (snd_rawmidi_drain(lp->midi_out) < 0) return LP_ERROR_MIDI_DRAIN;
+// Dim all the LEDs to [level], from 0 for the dimmest to 1 for the
+// brightest, setting the closest duty cycle. Nothing is sent if the
+// duty cycle does not change.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_set_dimmer(LP *lp, double level);
 
-  return LP_OK;
-}
+// Make the LED of [key] blink between the colors [on] and [off],
+// enabling flashing if needed. Before enabling it, the displayed
+// buffer is copied over the other one if they differ, so that only
+// [key] blinks. The device then keeps it blinking without any further
+// message. If [on] and [off] are the same color,
+// the LED stops blinking.
+// Note: while flashing, the LEDs must be set with LP_COLOR_FLAG_COPY
+// not to blink, and setting the double buffering flags, for example
+// with `lp_begin_frame`, stops flashing.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_set_blinking(LP *lp, LPNoteKey key,
+                                     LPNoteColor on, LPNoteColor off);
 
-LIBLAUNCHPAD_DEF int lp_close(LP *lp)
-{
-  if (!lp) return LP_OK;
-  if (lp->midi_in)
-    if (snd_rawmidi_close(lp->midi_in) < 0) return LP_ERROR_MIDI_CLOSE;
-  if (lp->midi_out)
-    if (snd_rawmidi_close(lp->midi_out) < 0) return LP_ERROR_MIDI_CLOSE;
-  
-  return LP_OK;
-}
+// Hold the notes set with `lp_set_note` for [window] microseconds,
+// keeping only the last color of each key, and write them at once
+// when the window closes, see Coalescing. A [window] of 0 disables
+// coalescing and writes the notes held.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_set_coalescing(LP *lp, unsigned int window);
 
-LIBLAUNCHPAD_DEF int lp_set_note(LP *lp, LPNote note)
-{
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_out) return LP_ERROR_UNINITIALIZED;
-    
-  unsigned char msg_buff[3] = { note.state, note.key, note.color };
-  size_t bytes = snd_rawmidi_write(lp->midi_out, msg_buff, sizeof(msg_buff));
-  if (bytes != 3) return LP_ERROR_MIDI_WRITE;
-  if (snd_rawmidi_drain(lp->midi_out) < 0) return LP_ERROR_MIDI_DRAIN;
-  
-  return LP_OK;
-}
+// With non-blocking output, write the bytes that the device did not
+// take yet, followed by the messages waiting in the library.
+// Call this when the descriptors from `lp_output_descriptors` are
+// writable.
+// Returns LP_OK when everything was written, LP_PENDING if some bytes
+// are still waiting, or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_resume(LP *lp);
 
-LIBLAUNCHPAD_DEF int lp_set_notes(LP *lp, LPNote notes[LP_ROWS * LP_COLS])
-{
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_out) return LP_ERROR_UNINITIALIZED;
-  if (!notes) return LP_ERROR_ARGUMENT_NULL;
-  
-  unsigned char msg_buff[3 * LP_ROWS * LP_COLS];
-  for (int i = 0; i < LP_ROWS; ++i)
-    for (int j = 0; j < LP_COLS; ++j)
-    {
-      unsigned char command_buff[3] = { notes[i * LP_ROWS + j].state,
-                                        notes[i * LP_ROWS + j].key,
-                                        notes[i * LP_ROWS + j].color };
-      memcpy(msg_buff + 3 * (i * LP_COLS + j), command_buff, sizeof(command_buff));
-    }
+// Fill [pfds] with at most [space] descriptors to poll to know when
+// the output can be written.
+// Returns the number of descriptors filled or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int
+lp_output_descriptors(LP *lp, struct pollfd *pfds, unsigned int space);
 
-  size_t bytes = snd_rawmidi_write(lp->midi_out, msg_buff, sizeof(msg_buff));
-  if (bytes != 3 * LP_ROWS * LP_COLS) return LP_ERROR_MIDI_WRITE;
-  if (snd_rawmidi_drain(lp->midi_out) < 0) return LP_ERROR_MIDI_DRAIN;
-  
-  return LP_OK;
-}
+// Start a batch: until `lp_flush` is called, the messages of all the
+// functions above are collected in the output buffer of [lp] instead
+// of being written and drained one call at a time.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_begin_batch(LP *lp);
 
-LIBLAUNCHPAD_DEF int
-lp_set_double_buffering_flags(LP *lp, LPDoubleBufferingFlag flags)
-{
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_out) return LP_ERROR_UNINITIALIZED;
-  
-  unsigned char msg_buff[3] = { 0xB0, 0, flags + 0x20 };
-  size_t bytes = snd_rawmidi_write(lp->midi_out, msg_buff, sizeof(msg_buff));
-  if (bytes != 3) return LP_ERROR_MIDI_WRITE;
-  if (snd_rawmidi_drain(lp->midi_out) < 0) return LP_ERROR_MIDI_DRAIN;
-  
-  return LP_OK;
-}
+// Set the [priority] of the messages written from now on. Messages of
+// higher priority are sent ahead of lower priority messages still
+// waiting in a batch or for the writer thread, which also writes low
+// priority messages a bit at a time so that more urgent ones do not
+// wait for long. Messages are never split, and the LEDs set by
+// messages that jump ahead become unknown to `lp_present` as they may
+// be overwritten by the messages they overtook.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_set_priority(LP *lp, LPPriority priority);
 
-LIBLAUNCHPAD_DEF int lp_swap_buffers(LP *lp)
-{
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_out) return LP_ERROR_UNINITIALIZED;
+// End the batch, writing the collected messages to the device with a
+// single write. If [drain] is true, wait until all the bytes have
+// been physically sent.
+// With the writer thread, wait until it has written all the messages
+// sent so far, use this to know when the device received them.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_flush(LP *lp, bool drain);
 
-  if (lp->current_buff == 0)
-  {
-    lp->current_buff = 1;
-    return lp_set_double_buffering_flags(lp, LP_DOUBLE_BUFFERING_DISPLAY_1
-                                         | LP_DOUBLE_BUFFERING_UPDATE_0
-                                         | LP_DOUBLE_BUFFERING_COPY);
-  }
-  else
-  {
-    lp->current_buff = 0;
-    return lp_set_double_buffering_flags(lp, LP_DOUBLE_BUFFERING_DISPLAY_0
-                                         | LP_DOUBLE_BUFFERING_UPDATE_1
-                                         | LP_DOUBLE_BUFFERING_COPY);
-  }
-}
-  
-LIBLAUNCHPAD_DEF int lp_check_event(LP *lp, LPEvent *event)
-{
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_in) return LP_ERROR_UNINITIALIZED;
+// Initialize [command_buffer] to record messages in [buff], which
+// holds [capacity] bytes and must outlive the command buffer
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_command_buffer_init(LPCommandBuffer *command_buffer,
+                                            unsigned char *buff,
+                                            size_t capacity);
 
-  unsigned char event_buff[3];
-  int err = snd_rawmidi_read(lp->midi_in, event_buff, sizeof(event_buff));
-  if (err == -EAGAIN) return 0; // nothing to read
-  if (err < 0) return LP_ERROR_MIDI_READ;
-  if (err == 3) {
-    unsigned char status = event_buff[0];
-    unsigned char note   = event_buff[1];
-    unsigned char velocity = event_buff[2];
+// Start recording in [command_buffer], after what it already holds,
+// the messages of the functions called on [lp] instead of writing
+// them to the device.
+// The functions return LP_ERROR_BUFFER_FULL for the messages that do
+// not fit in the command buffer, or that would make the recording
+// longer than LIBLAUNCHPAD_OUT_BUFFER_SIZE bytes, which are not
+// recorded.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_begin_record(LP *lp, LPCommandBuffer *command_buffer);
+
+// Stop recording, the functions write to the device again
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_end_record(LP *lp);
+
+// Write the messages recorded in [command_buffer] to the device, at
+// once
+// Returns either LP_OK or a negative LP_ERROR, LP_ERROR_BUFFER_FULL if
+// it holds more than LIBLAUNCHPAD_OUT_BUFFER_SIZE bytes.
+LIBLAUNCHPAD_DEF int lp_replay(LP *lp, const LPCommandBuffer *command_buffer);
+
+// Register a page called [name] with the colors of [frame], or with
+// all the LEDs off if [frame] is NULL. Color flags are ignored.
+// Returns the index of the page or a negative LP_ERROR,
+// LP_ERROR_PAGES_FULL if LIBLAUNCHPAD_PAGES pages are registered or
+// LP_ERROR_NAME_TOO_LONG if [name] does not fit in
+// LIBLAUNCHPAD_PAGE_NAME_SIZE bytes.
+LIBLAUNCHPAD_DEF int
+lp_add_page(LP *lp, const char *name, LPNoteColor frame[LP_LEDS]);
+
+// Returns the index of the page called [name] or a negative LP_ERROR,
+// LP_ERROR_NO_PAGE if there is no such page
+LIBLAUNCHPAD_DEF int lp_find_page(LP *lp, const char *name);
+
+// Unregister the page at index [page]
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_remove_page(LP *lp, int page);
+
+// Set the LED at [index] of a frame to [color] in the page at index
+// [page], also on the device if the page is the one shown
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int
+lp_set_page_led(LP *lp, int page, int index, LPNoteColor color);
+
+// Show the page at index [page]. If the page is already in the buffer
+// that is not displayed, the buffers are swapped, else the page is
+// drawn there first. The page ends up in the buffer that is both
+// displayed and updated.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int lp_show_page(LP *lp, int page);
+
+// Set [hits] and [misses] to the number of frames found and not found
+// in the frame cache since the device was opened, to help choosing
+// LIBLAUNCHPAD_FRAME_CACHE_SIZE. Either can be NULL.
+// Returns either LP_OK or a negative LP_ERROR, LP_ERROR_UNSUPPORTED
+// without LIBLAUNCHPAD_FRAME_CACHE.
+LIBLAUNCHPAD_DEF int
+lp_frame_cache_stats(LP *lp, size_t *hits, size_t *misses);
+
+//
+// Encoding functions
+//
+// Each one writes a message to [buff], which must hold at least
+// LP_MESSAGE_SIZE bytes unless stated otherwise, and returns the
+// number of bytes written.
+//
+
+// Encode the message that resets the device, turning the lights off
+LIBLAUNCHPAD_DEF size_t lp_encode_reset(unsigned char *buff);
+
+// Encode the universal device inquiry message
+LIBLAUNCHPAD_DEF size_t lp_encode_device_inquiry(unsigned char *buff);
+
+// Parse the reply to the device inquiry in the [size] bytes of [buff]
+// to [capabilities]
+// Returns whether [buff] holds a reply.
+LIBLAUNCHPAD_DEF bool
+lp_parse_device_inquiry(const unsigned char *buff, size_t size,
+                        LPCapabilities *capabilities);
+
+// Encode the message that sets the LEDs of [frame] that are not
+// LP_COLOR_UNKNOWN on the RGB [model], with the red and green levels
+// of the colors mapped to RGB. [buff] must hold at least
+// LP_RGB_MESSAGE_SIZE(LP_LEDS) bytes.
+// Returns 0 if [model] has no RGB LEDs or no LED is set.
+LIBLAUNCHPAD_DEF size_t lp_encode_rgb(unsigned char *buff, LPModel model,
+                                      LPNoteColor frame[LP_LEDS]);
+
+// Encode the message that turns off all the LEDs of the RGB [model]
+// Returns 0 if [model] has no RGB LEDs.
+LIBLAUNCHPAD_DEF size_t lp_encode_rgb_clear(unsigned char *buff,
+                                            LPModel model);
+
+// Encode the message that selects the key [layout], which also moves
+// the rapid update cursor back to the first LED
+LIBLAUNCHPAD_DEF size_t lp_encode_layout(unsigned char *buff,
+                                         LPLayout layout);
+
+// Encode the message that sets [note]
+LIBLAUNCHPAD_DEF size_t lp_encode_note(unsigned char *buff, LPNote note);
+
+// Encode the message that sets the LED of column [col] of the Automap
+// row to [color]
+LIBLAUNCHPAD_DEF size_t
+lp_encode_automap(unsigned char *buff, unsigned char col, LPNoteColor color);
+
+// Encode a rapid update message, setting the next two LEDs of the
+// device to [first] and [second]
+LIBLAUNCHPAD_DEF size_t lp_encode_rapid_update(unsigned char *buff,
+                                               LPNoteColor first,
+                                               LPNoteColor second);
+
+// Encode the test command that resets the device and turns all the
+// LEDs yellow at [brightness]
+// Returns 0 if [brightness] is LP_BRIGHTNESS_OFF.
+LIBLAUNCHPAD_DEF size_t lp_encode_test(unsigned char *buff,
+                                       LPNoteBrightness brightness);
+
+// Encode the messages that set all the LEDs to [frame] with rapid
+// updates, [buff] must hold at least LP_FRAME_MESSAGE_SIZE bytes
+LIBLAUNCHPAD_DEF size_t lp_encode_frame(unsigned char *buff,
+                                        LPNoteColor frame[LP_LEDS]);
+
+// Encode the message that sets the double buffering [flags]
+LIBLAUNCHPAD_DEF size_t
+lp_encode_double_buffering_flags(unsigned char *buff,
+                                 LPDoubleBufferingFlag flags);
+
+// Encode the message that enables flashing if [enable], or disables it
+LIBLAUNCHPAD_DEF size_t lp_encode_flashing(unsigned char *buff, bool enable);
+
+// Encode the message that scrolls [text] as `lp_scroll_text` does,
+// [buff] must hold at least LP_TEXT_MESSAGE_SIZE(strlen(text)) bytes
+// Returns 0 if [speed] is out of range.
+LIBLAUNCHPAD_DEF size_t lp_encode_text(unsigned char *buff, const char *text,
+                                       LPNoteColor color, unsigned char speed,
+                                       bool loop);
+
+// Encode the message that sets the duty cycle of the LEDs to
+// [numerator] / [denominator], with [numerator] from 1 to 16 and
+// [denominator] from 3 to 18. Lower duty cycles make the LEDs dimmer.
+// Returns 0 if the duty cycle is out of range.
+LIBLAUNCHPAD_DEF size_t lp_encode_duty_cycle(unsigned char *buff,
+                                             unsigned char numerator,
+                                             unsigned char denominator);
+
+//
+// Internal functions
+//
+
+// Write [size] bytes of complete messages from [buff] to the device,
+// after the frame in the mailbox and the notes held in the coalescing
+// window if any. Outside of a batch, the bytes are written and drained
+// right away.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_write(LP *lp, const unsigned char *buff, size_t size);
+
+// Append [size] bytes from [buff] to the command buffer being recorded
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int
+_lp_record(LP *lp, const unsigned char *buff, size_t size);
+
+// Like `_lp_write`, for messages already tracked in the shadow buffers
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int
+_lp_output(LP *lp, const unsigned char *buff, size_t size);
+
+// Append [size] bytes from [buff] to the [lane] of the output buffer,
+// writing it out when full. With non-blocking output, nothing is
+// appended if there is no room for all the bytes.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_append(LP *lp, LPPriority lane,
+                                const unsigned char *buff, size_t size);
+
+// Write [size] bytes of complete messages from [buff] to the transport.
+// Note messages that repeat the status byte of the previous note
+// message are sent without it (MIDI running status), any other
+// message is always sent with its status byte and ends the run.
+// With non-blocking output, the bytes the device does not take are
+// moved to unsent, which must be empty and hold [size] bytes.
+// Returns LP_OK, LP_PENDING or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_send(LP *lp, const unsigned char *buff, size_t size);
+
+// Write the bytes in unsent that were not written yet
+// Returns LP_OK, LP_PENDING or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_send_unsent(LP *lp);
+
+// Returns whether the shadow of buffer [buff] is known to hold [frame],
+// which has no color flags and may have unknown LEDs
+LIBLAUNCHPAD_DEF bool
+_lp_buff_holds(LP *lp, int buff, LPNoteColor frame[LP_LEDS]);
+
+// Returns the double buffering flags that display buffer [display]
+// and update buffer [update]
+LIBLAUNCHPAD_DEF LPDoubleBufferingFlag _lp_buffer_flags(int display,
+                                                        int update);
+
+// Encode [frame] in [buff] like `lp_encode_frame`, copying the
+// messages from the frame cache when the frame is in it
+// Returns the number of bytes encoded.
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_frame_cached(LP *lp, unsigned char *buff,
+                        LPNoteColor frame[LP_LEDS]);
+
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+
+// Returns the FNV-1a hash of [frame]
+LIBLAUNCHPAD_DEF uint32_t _lp_frame_hash(LPNoteColor frame[LP_LEDS]);
+
+#endif // LIBLAUNCHPAD_FRAME_CACHE
+
+// Move the frame in the mailbox, if any, to the lane of the output
+// buffer it was submitted to
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_commit_mailbox(LP *lp);
+
+// Move the notes held in the coalescing window, if any, to the output
+// buffer
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_commit_coalesced(LP *lp);
+
+// Write the notes held in the coalescing window if it expired
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_check_coalesced(LP *lp);
+
+// Encode to [buff] the notes held in the coalescing window and stop
+// holding them, only if the window expired when [expired] is true
+// Returns the number of bytes in [buff].
+LIBLAUNCHPAD_DEF size_t
+_lp_take_coalesced(LP *lp, unsigned char *buff, bool expired);
+
+// Returns the microseconds left before the coalescing window closes,
+// 0 if it expired, or -1 if no note is held
+LIBLAUNCHPAD_DEF long _lp_coalesced_left(LP *lp);
+
+// Lock the mailbox and the notes held, only with the writer thread
+LIBLAUNCHPAD_DEF void _lp_lock(LP *lp);
+LIBLAUNCHPAD_DEF void _lp_unlock(LP *lp);
+
+// Returns the number of bytes waiting in the output buffer of the
+// driver, or 0 if it cannot be known
+LIBLAUNCHPAD_DEF size_t _lp_out_queued(LP *lp);
+
+// Apply the non-zero values of [params] to the MIDI streams of the
+// ALSA transport, then read back the parameters in use
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_set_midi_params(LP *lp, const LPMidiParams *params);
+
+// Wait until the transport has sent everything, measuring the throughput
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_drain(LP *lp);
+
+// Update the throughput of the output after [sent] bytes have been
+// written to the driver
+LIBLAUNCHPAD_DEF void _lp_measure(LP *lp, size_t sent);
+
+// Add a sample of [bytes] absorbed by the device in [seconds] to the
+// estimated throughput of the output
+LIBLAUNCHPAD_DEF void _lp_rate_sample(LP *lp, size_t bytes, double seconds);
+
+// Returns the seconds elapsed from [from] to [to]
+LIBLAUNCHPAD_DEF double _lp_elapsed(const struct timespec *from,
+                                    const struct timespec *to);
+
+// Update the shadow buffers of [lp] with the effects of the [size]
+// bytes of complete messages in [buff]. If not [known], the LEDs set
+// by the messages become unknown.
+LIBLAUNCHPAD_DEF void _lp_track(LP *lp, const unsigned char *buff,
+                                size_t size, bool known);
+
+// Set the LED at [index] of a frame to [color] in the shadow buffers,
+// honoring the color flags, or to unknown if not [known]
+LIBLAUNCHPAD_DEF void _lp_track_led(LP *lp, int index, LPNoteColor color,
+                                    bool known);
+
+// Returns whether messages of priority lower than the current one are
+// waiting to be sent
+LIBLAUNCHPAD_DEF bool _lp_lower_lanes_pending(LP *lp);
+
+// Returns whether setting the LED at [index] of a frame to [color]
+// would change the shadow buffers
+LIBLAUNCHPAD_DEF bool _lp_led_changed(LP *lp, int index, LPNoteColor color);
+
+// Set the LEDs of the updating buffer to [frame] like `lp_present`,
+// leaving alone the LEDs that are LP_COLOR_UNKNOWN in [frame]. If
+// [commands], also consider the reset and test commands when they have
+// no other visible effect.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_draw(LP *lp, LPNoteColor frame[LP_LEDS],
+                              bool commands);
+
+// Encode in [buff] the reset or test command that turns all the LEDs
+// to [frame] without any other visible effect
+// Returns the size of the command, or 0 if there is none.
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_fill_command(LP *lp, unsigned char *buff,
+                        LPNoteColor frame[LP_LEDS]);
+
+// Encode [note] like `lp_encode_note`, with its key translated to the
+// layout of [lp]
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_note(LP *lp, unsigned char *buff, LPNote note);
+
+// Encode [frame] like `lp_encode_frame`, rewinding the rapid update
+// cursor by selecting the layout of [lp]
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_frame(LP *lp, unsigned char *buff, LPNoteColor frame[LP_LEDS]);
+
+// Translate the [size] bytes of Launchpad S messages in [buff] to the
+// messages of the RGB model of [lp] in [rgb_buff], which must hold
+// LP_RGB_CLEAR_MESSAGE_SIZE + LP_RGB_MESSAGE_SIZE(LP_LEDS) bytes. The
+// LEDs set are sent in a single message, keeping the last color of
+// each, after a message that turns all of them off if a reset came
+// first. Messages with no RGB counterpart are dropped, and rapid
+// updates start from LED [cursor] until another message rewinds it.
+// Returns the number of bytes in [rgb_buff].
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_rgb_stream(LP *lp, const unsigned char *buff, size_t size,
+                      int cursor, unsigned char *rgb_buff);
+
+// Returns the device identifier in the sysex messages of the RGB
+// [model], or 0 if [model] has no RGB LEDs
+LIBLAUNCHPAD_DEF unsigned char _lp_rgb_device(LPModel model);
+
+// Returns the LED of the RGB [model] at [index] of a frame
+LIBLAUNCHPAD_DEF unsigned char _lp_rgb_led(LPModel model, int index);
+
+// Returns the key of the button of [lp] that sends the control change
+// [control], or LP_KEY_NONE
+LIBLAUNCHPAD_DEF LPNoteKey _lp_control_key(LP *lp, unsigned char control);
+
+// Fill the tables that translate keys to the notes of the layout of
+// [lp] and back
+LIBLAUNCHPAD_DEF void _lp_init_layout(LP *lp);
+
+// Send the device inquiry and wait for the reply, setting
+// [capabilities] to those of the original Launchpad if none comes.
+// Anything else the device sends meanwhile is dropped.
+// Returns either LP_OK or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_probe(LP *lp, LPCapabilities *capabilities);
+
+// Returns LP_OK if [options] can be used to open a device, or a
+// negative LP_ERROR
+LIBLAUNCHPAD_DEF int _lp_check_options(const LPOptions *options);
+
+// Set up [lp] to talk to the device through [transport], already
+// open, and probe it with [options]. The capabilities are cached
+// under [devicename] unless it is NULL.
+// Returns either LP_OK or a negative LP_ERROR, closing [transport] on
+// error.
+LIBLAUNCHPAD_DEF int _lp_open(LP *lp, const LPTransport *transport,
+                              void *context, const char *devicename,
+                              const LPOptions *options);
+
+// Functions of the ALSA rawmidi transport, [context] is an
+// LPAlsaTransport
+LIBLAUNCHPAD_DEF ssize_t
+_lp_alsa_write(void *context, const unsigned char *buff, size_t size);
+LIBLAUNCHPAD_DEF ssize_t
+_lp_alsa_read(void *context, unsigned char *buff, size_t size);
+LIBLAUNCHPAD_DEF int
+_lp_alsa_poll_descriptors(void *context, bool output,
+                          struct pollfd *pfds, unsigned int space);
+LIBLAUNCHPAD_DEF int
+_lp_alsa_set_nonblocking(void *context, bool output, bool nonblocking);
+LIBLAUNCHPAD_DEF int _lp_alsa_flush(void *context);
+LIBLAUNCHPAD_DEF size_t _lp_alsa_queued(void *context);
+LIBLAUNCHPAD_DEF int _lp_alsa_close(void *context);
+
+// Returns the index in a frame of the note [key], or -1 if the key
+// is not on the device
+LIBLAUNCHPAD_DEF int _lp_key_index(LPNoteKey key);
+
+// Returns the note key of the LED at [index] of a frame
+LIBLAUNCHPAD_DEF LPNoteKey _lp_index_key(int index);
+
+// Write the content of the output buffer to the device, without
+// draining it, from the highest priority lane to the lowest. With the
+// writer thread, queue each lane in its ring instead. With
+// non-blocking output, the lanes wait until unsent is written.
+// Returns LP_OK, LP_PENDING or a negative LP_ERROR.
+LIBLAUNCHPAD_DEF int _lp_write_out_buff(LP *lp);
+
+#ifdef LIBLAUNCHPAD_THREADED
+
+// Queue [size] bytes from [buff] in [ring], posting [consumer] for
+// each chunk queued and waiting for the consumer if there is not
+// enough space
+LIBLAUNCHPAD_DEF void _lp_ring_push(LPRing *ring, sem_t *consumer,
+                                    const unsigned char *buff, size_t size);
+
+// Copy to [buff] the bytes at the tail of [ring], stopping at the
+// first message boundary after [size] bytes or when the ring is empty.
+// [buff] must hold LIBLAUNCHPAD_RING_SIZE bytes.
+// Returns the number of bytes copied, which are still in the ring.
+LIBLAUNCHPAD_DEF size_t
+_lp_ring_peek(LPRing *ring, unsigned char *buff, size_t size);
+
+// Body of the writer thread of the LP in [arg]
+LIBLAUNCHPAD_DEF void *_lp_writer(void *arg);
+
+#endif // LIBLAUNCHPAD_THREADED
+  
+//
+// Implementation
+//
+
+#ifdef LIBLAUNCHPAD_IMPLEMENTATION
+
+// The transport of `lp_open_ex`
+static const LPTransport _lp_alsa_transport = {
+  .write = _lp_alsa_write,
+  .read = _lp_alsa_read,
+  .poll_descriptors = _lp_alsa_poll_descriptors,
+  .set_nonblocking = _lp_alsa_set_nonblocking,
+  .flush = _lp_alsa_flush,
+  .queued = _lp_alsa_queued,
+  .close = _lp_alsa_close,
+};
+
+LIBLAUNCHPAD_DEF int lp_open(LP *lp, char *devicename, bool nonblocking)
+{
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.nonblocking = nonblocking;
+  return lp_open_ex(lp, devicename, &options);
+}
+
+LIBLAUNCHPAD_DEF int
+lp_open_ex(LP *lp, char *devicename, const LPOptions *options)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!options) return LP_ERROR_ARGUMENT_NULL;
+  int err = _lp_check_options(options);
+  if (err < 0) return err;
+
+  int flags = 0;
+  if (options->nonblocking || options->nonblocking_output)
+    flags |= SND_RAWMIDI_NONBLOCK;
+  if (snd_rawmidi_open(&lp->alsa.midi_in, &lp->alsa.midi_out,
+                       devicename, flags) < 0)
+    return LP_ERROR_OPENING_LAUNCHPAD;
+  if (_lp_set_midi_params(lp, &options->params) < 0)
+  {
+    _lp_alsa_close(&lp->alsa);
+    return LP_ERROR_MIDI_PARAMS;
+  }
+  return _lp_open(lp, &_lp_alsa_transport, &lp->alsa, devicename, options);
+}
+
+LIBLAUNCHPAD_DEF int lp_open_transport(LP *lp, const LPTransport *transport,
+                                       void *context,
+                                       const LPOptions *options)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!transport || !options) return LP_ERROR_ARGUMENT_NULL;
+  if (!transport->write || !transport->read
+      || !transport->poll_descriptors || !transport->set_nonblocking
+      || !transport->flush || !transport->close)
+    return LP_ERROR_ARGUMENT_NULL;
+  int err = _lp_check_options(options);
+  if (err < 0) return err;
+
+  // The parameters belong to the driver of the ALSA transport
+  memset(&lp->params, 0, sizeof(lp->params));
+  return _lp_open(lp, transport, context, NULL, options);
+}
+
+LIBLAUNCHPAD_DEF int _lp_check_options(const LPOptions *options)
+{
+  if (options->layout != LP_LAYOUT_XY
+      && options->layout != LP_LAYOUT_DRUM_RACK)
+    return LP_ERROR_UNSUPPORTED;
+#ifndef LIBLAUNCHPAD_THREADED
+  if (options->threaded) return LP_ERROR_UNSUPPORTED;
+#endif
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int _lp_open(LP *lp, const LPTransport *transport,
+                              void *context, const char *devicename,
+                              const LPOptions *options)
+{
+  lp->transport = transport;
+  lp->transport_context = context;
+  lp->running_status = 0;
+  memset(lp->out_size, 0, sizeof(lp->out_size));
+  lp->batching = false;
+  lp->recording = NULL;
+  lp->nonblocking_input = options->nonblocking;
+  lp->unsent_size = 0;
+  lp->unsent_offset = 0;
+  lp->priority = LP_PRIORITY_NORMAL;
+  lp->update_buff = 0;
+  memset(lp->shadow, LP_COLOR_UNKNOWN, sizeof(lp->shadow));
+  lp->rapid_cursor = 0;
+  lp->flashing = false;
+  lp->duty_numerator = 0;
+  lp->duty_denominator = 0;
+  lp->mailbox_full = false;
+  for (int i = 0; i < LIBLAUNCHPAD_PAGES; ++i)
+    lp->pages[i].used = false;
+  lp->active_page = -1;
+  // The device displays buffer 0 when powered on
+  lp->current_buff = 0;
+  lp->out_rate = 0;
+  clock_gettime(CLOCK_MONOTONIC, &lp->rate_time);
+  lp->rate_queued = 0;
+  lp->rate_sent = 0;
+  lp->frame_bytes = 0;
+  lp->pace_bytes = 0;
+  lp->pace_time = lp->rate_time;
+  lp->coalesce_window = LIBLAUNCHPAD_COALESCE_WINDOW;
+  memset(lp->coalesced, LP_COLOR_UNKNOWN, sizeof(lp->coalesced));
+  lp->coalesced_count = 0;
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+  for (int i = 0; i < LIBLAUNCHPAD_FRAME_CACHE_SIZE; ++i)
+    lp->frame_cache[i].last_use = 0;
+  lp->frame_cache_clock = 0;
+  lp->frame_cache_hits = 0;
+  lp->frame_cache_misses = 0;
+#endif
+  lp->layout = options->layout;
+  lp->capabilities = (LPCapabilities){ LP_MODEL_UNKNOWN, 0,
+                                       LP_CAPABILITIES_LAUNCHPAD_S };
+#ifdef LIBLAUNCHPAD_THREADED
+  lp->threaded = false;
+#endif
+
+  // Talk to the device before the writer thread starts, waiting for
+  // the messages to be sent
+  int err = LP_OK;
+  lp->nonblocking_output = false;
+  if (transport->set_nonblocking(context, true, false) < 0)
+    err = LP_ERROR_OPENING_LAUNCHPAD;
+  if (err >= 0 && options->probe)
+  {
+    LPCapabilityCache *cache = devicename ? options->capability_cache : NULL;
+    int cached = -1;
+    for (int i = 0; cache && i < LIBLAUNCHPAD_CAPABILITY_CACHE_SIZE; ++i)
+      if (cache->entries[i].used
+          && strcmp(cache->entries[i].devicename, devicename) == 0)
+        cached = i;
+    if (cached >= 0)
+      lp->capabilities = cache->entries[cached].capabilities;
+    else
+      err = _lp_probe(lp, &lp->capabilities);
+    if (err >= 0 && cached < 0 && cache
+        && strlen(devicename) < LIBLAUNCHPAD_DEVICE_NAME_SIZE)
+    {
+      cached = cache->next;
+      cache->next = (cache->next + 1) % LIBLAUNCHPAD_CAPABILITY_CACHE_SIZE;
+      cache->entries[cached].used = true;
+      strcpy(cache->entries[cached].devicename, devicename);
+      cache->entries[cached].capabilities = lp->capabilities;
+    }
+  }
+  // Each direction blocks or not following its own option
+  if (err >= 0
+      && transport->set_nonblocking(context, false, options->nonblocking) < 0)
+    err = LP_ERROR_OPENING_LAUNCHPAD;
+  // RGB models have a single layout
+  if (lp->capabilities.flags & LP_CAPABILITY_RGB)
+    lp->layout = LP_LAYOUT_XY;
+  _lp_init_layout(lp);
+  // The device starts in the X-Y layout
+  if (err >= 0 && lp->layout != LP_LAYOUT_XY)
+  {
+    unsigned char msg_buff[LP_MESSAGE_SIZE];
+    size_t size = lp_encode_layout(msg_buff, lp->layout);
+    err = _lp_write(lp, msg_buff, size);
+  }
+  bool nonblocking_output = options->nonblocking_output;
+#ifdef LIBLAUNCHPAD_THREADED
+  // The writer thread waits for the device
+  if (options->threaded) nonblocking_output = false;
+#endif
+  if (err >= 0
+      && transport->set_nonblocking(context, true, nonblocking_output) < 0)
+    err = LP_ERROR_OPENING_LAUNCHPAD;
+  if (err < 0)
+  {
+    lp_close(lp);
+    return err;
+  }
+  lp->nonblocking_output = nonblocking_output;
+
+#ifdef LIBLAUNCHPAD_THREADED
+  lp->threaded = options->threaded;
+  if (!lp->threaded) return LP_OK;
+
+  for (int i = 0; i < LP_PRIORITIES; ++i)
+  {
+    lp->rings[i].head = 0;
+    lp->rings[i].tail = 0;
+  }
+  lp->flush_pending = false;
+  lp->writer_stop = false;
+  lp->writer_error = LP_OK;
+  if (sem_init(&lp->writer_sem, 0, 0) < 0
+      || sem_init(&lp->flush_sem, 0, 0) < 0
+      || pthread_mutex_init(&lp->mailbox_lock, NULL) != 0
+      || pthread_create(&lp->writer, NULL, _lp_writer, lp) != 0)
+  {
+    lp->threaded = false;
+    lp_close(lp);
+    return LP_ERROR_THREAD;
+  }
+#endif
+  
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_get_capabilities(LP *lp,
+                                         LPCapabilities *capabilities)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!capabilities) return LP_ERROR_ARGUMENT_NULL;
+
+  *capabilities = lp->capabilities;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_capability_cache_init(LPCapabilityCache *cache)
+{
+  if (!cache) return LP_ERROR_ARGUMENT_NULL;
+
+  for (int i = 0; i < LIBLAUNCHPAD_CAPABILITY_CACHE_SIZE; ++i)
+    cache->entries[i].used = false;
+  cache->next = 0;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_get_midi_params(LP *lp, LPMidiParams *params)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!params) return LP_ERROR_ARGUMENT_NULL;
+
+  *params = lp->params;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_reset(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  
+  // A reset also selects the X-Y layout
+  unsigned char msg_buff[2 * LP_MESSAGE_SIZE];
+  size_t size = lp_encode_reset(msg_buff);
+  if (lp->layout != LP_LAYOUT_XY)
+    size += lp_encode_layout(msg_buff + size, lp->layout);
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_close(LP *lp)
+{
+  if (!lp) return LP_OK;
+
+  // Whatever fails, the writer thread is stopped and the transport
+  // closed, then the first error is returned
+  int err = LP_OK;
+  if (lp->transport && lp->nonblocking_output)
+  {
+    // Wait for the device to take what is left
+    lp->transport->set_nonblocking(lp->transport_context, true, false);
+    lp->nonblocking_output = false;
+  }
+  if (lp->transport && _lp_commit_mailbox(lp) < 0)
+    err = LP_ERROR_MIDI_WRITE;
+  if (lp->transport && err == LP_OK && _lp_commit_coalesced(lp) < 0)
+    err = LP_ERROR_MIDI_WRITE;
+  if (lp->transport && err == LP_OK && _lp_write_out_buff(lp) < 0)
+    err = LP_ERROR_MIDI_WRITE;
+#ifdef LIBLAUNCHPAD_THREADED
+  if (lp->threaded)
+  {
+    // The writer thread writes what is left in the rings before exiting
+    __atomic_store_n(&lp->writer_stop, true, __ATOMIC_SEQ_CST);
+    sem_post(&lp->writer_sem);
+    pthread_join(lp->writer, NULL);
+    sem_destroy(&lp->writer_sem);
+    sem_destroy(&lp->flush_sem);
+    pthread_mutex_destroy(&lp->mailbox_lock);
+    lp->threaded = false;
+    if (err == LP_OK && lp->writer_error < 0) err = LP_ERROR_MIDI_WRITE;
+  }
+#endif
+  if (lp->transport)
+  {
+    const LPTransport *transport = lp->transport;
+    lp->transport = NULL;
+    if (transport->close(lp->transport_context) < 0 && err == LP_OK)
+      err = LP_ERROR_MIDI_CLOSE;
+  }
+
+  return err;
+}
+
+LIBLAUNCHPAD_DEF int lp_set_note(LP *lp, LPNote note)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
     
-    if (event && status == 0x90)
+  unsigned char msg_buff[LP_MESSAGE_SIZE];
+  size_t size = _lp_encode_note(lp, msg_buff, note);
+  int index = _lp_key_index(note.key);
+  if (lp->coalesce_window == 0 || note.state != LP_NOTE_ON || index < 0
+      || lp->recording)
+    return _lp_write(lp, msg_buff, size);
+
+  // Held notes are tracked now, in the order they were set, as they
+  // are sent before any message written after them
+  _lp_track(lp, msg_buff, size, !_lp_lower_lanes_pending(lp));
+  _lp_lock(lp);
+  if (lp->coalesced_count == 0)
+    clock_gettime(CLOCK_MONOTONIC, &lp->coalesce_time);
+  if (lp->coalesced[index] == LP_COLOR_UNKNOWN) lp->coalesced_count++;
+  lp->coalesced[index] = note.color;
+  _lp_unlock(lp);
+#ifdef LIBLAUNCHPAD_THREADED
+  // The writer thread closes the window when it expires
+  if (lp->threaded) sem_post(&lp->writer_sem);
+#endif
+  return _lp_check_coalesced(lp);
+}
+
+LIBLAUNCHPAD_DEF int lp_set_notes(LP *lp, LPNote notes[LP_ROWS * LP_COLS])
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!notes) return LP_ERROR_ARGUMENT_NULL;
+  
+  unsigned char msg_buff[LP_MESSAGE_SIZE * LP_ROWS * LP_COLS];
+  size_t size = 0;
+  for (int i = 0; i < LP_ROWS; ++i)
+    for (int j = 0; j < LP_COLS; ++j)
+      size += _lp_encode_note(lp, msg_buff + size, notes[i * LP_ROWS + j]);
+
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_set_leds(LP *lp, const LPNote *notes, size_t count)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!notes && count > 0) return LP_ERROR_ARGUMENT_NULL;
+
+  int last[LP_LEDS];
+  for (int i = 0; i < LP_LEDS; ++i) last[i] = -1;
+  for (size_t i = 0; i < count; ++i)
+  {
+    int index = _lp_key_index(notes[i].key);
+    if (index < 0) return LP_ERROR_UNSUPPORTED;
+    last[index] = i;
+  }
+
+  // Frame order puts the notes before the Automap control changes
+  unsigned char msg_buff[LP_MESSAGE_SIZE * LP_LEDS];
+  size_t size = 0;
+  for (int i = 0; i < LP_LEDS; ++i)
+    if (last[i] >= 0)
+      size += _lp_encode_note(lp, msg_buff + size, notes[last[i]]);
+  if (size == 0) return LP_OK;
+
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_set_frame(LP *lp, LPNoteColor frame[LP_LEDS])
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!frame) return LP_ERROR_ARGUMENT_NULL;
+  if (!(lp->capabilities.flags
+        & (LP_CAPABILITY_RAPID_UPDATE | LP_CAPABILITY_RGB)))
+    return LP_ERROR_UNSUPPORTED;
+
+  unsigned char msg_buff[LP_FRAME_MESSAGE_SIZE];
+  size_t size = _lp_encode_frame_cached(lp, msg_buff, frame);
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_present(LP *lp, LPNoteColor frame[LP_LEDS])
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!frame) return LP_ERROR_ARGUMENT_NULL;
+
+  return _lp_draw(lp, frame, false);
+}
+
+LIBLAUNCHPAD_DEF int lp_fill(LP *lp, LPNoteColor color)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  LPNoteColor frame[LP_LEDS];
+  memset(frame, color, sizeof(frame));
+  return _lp_draw(lp, frame, true);
+}
+
+LIBLAUNCHPAD_DEF int lp_clear_region(LP *lp, int row, int col,
+                                     int rows, int cols)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (row < 0 || col < 0 || rows < 0 || cols < 0
+      || row + rows > LP_ROWS || col + cols > LP_COLS + 1)
+    return LP_ERROR_UNSUPPORTED;
+
+  LPNoteColor frame[LP_LEDS];
+  memset(frame, LP_COLOR_UNKNOWN, sizeof(frame));
+  for (int i = row; i < row + rows; ++i)
+    for (int j = col; j < col + cols; ++j)
+      frame[_lp_key_index(LP_KEY(i, j))] = 0;
+  return _lp_draw(lp, frame, true);
+}
+
+LIBLAUNCHPAD_DEF int lp_submit_frame(LP *lp, LPNoteColor frame[LP_LEDS])
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!frame) return LP_ERROR_ARGUMENT_NULL;
+  if (!(lp->capabilities.flags
+        & (LP_CAPABILITY_RAPID_UPDATE | LP_CAPABILITY_RGB)))
+    return LP_ERROR_UNSUPPORTED;
+  if (lp->recording) return lp_set_frame(lp, frame);
+
+  // What was written before must be sent before the frame
+  int err = _lp_commit_coalesced(lp);
+  if (err < 0) return err;
+  err = _lp_write_out_buff(lp);
+  if (err < 0) return err;
+  int pending = err;
+
+  // Encoded once, the same bytes are tracked and sent
+  unsigned char msg_buff[LP_FRAME_MESSAGE_SIZE];
+  size_t size = _lp_encode_frame_cached(lp, msg_buff, frame);
+  _lp_track(lp, msg_buff, size, true);
+  lp->pace_bytes += size;
+
+#ifdef LIBLAUNCHPAD_THREADED
+  if (lp->threaded)
+  {
+    pthread_mutex_lock(&lp->mailbox_lock);
+    memcpy(lp->mailbox, msg_buff, size);
+    lp->mailbox_size = size;
+    lp->mailbox_priority = lp->priority;
+    lp->mailbox_full = true;
+    pthread_mutex_unlock(&lp->mailbox_lock);
+    sem_post(&lp->writer_sem);
+    return LP_OK;
+  }
+#endif
+
+  memcpy(lp->mailbox, msg_buff, size);
+  lp->mailbox_size = size;
+  lp->mailbox_priority = lp->priority;
+  lp->mailbox_full = true;
+  // With non-blocking output, `lp_resume` sends the frame later
+  if (pending == LP_PENDING) return LP_PENDING;
+  if (lp->batching || _lp_out_queued(lp) > 0) return LP_OK;
+
+  err = _lp_commit_mailbox(lp);
+  if (err < 0) return err;
+  return _lp_write_out_buff(lp);
+}
+
+LIBLAUNCHPAD_DEF double lp_frame_interval(LP *lp)
+{
+  if (!lp) return LIBLAUNCHPAD_FRAME_INTERVAL;
+
+  size_t rate = __atomic_load_n(&lp->out_rate, __ATOMIC_RELAXED);
+  if (rate == 0 || lp->frame_bytes == 0) return LIBLAUNCHPAD_FRAME_INTERVAL;
+
+  double interval = LIBLAUNCHPAD_FRAME_HEADROOM * lp->frame_bytes / rate;
+  if (interval < LIBLAUNCHPAD_FRAME_INTERVAL_MIN)
+    return LIBLAUNCHPAD_FRAME_INTERVAL_MIN;
+  if (interval > LIBLAUNCHPAD_FRAME_INTERVAL_MAX)
+    return LIBLAUNCHPAD_FRAME_INTERVAL_MAX;
+  return interval;
+}
+
+LIBLAUNCHPAD_DEF int lp_pace(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  int err = _lp_check_coalesced(lp);
+  if (err < 0) return err;
+
+  // A frame held back while the device was busy is sent once it has
+  // caught up, the writer thread sends it by itself
+  bool idle = !lp->batching;
+#ifdef LIBLAUNCHPAD_THREADED
+  idle = idle && !lp->threaded;
+#endif
+  if (idle && lp->mailbox_full && _lp_out_queued(lp) == 0)
+  {
+    err = _lp_commit_mailbox(lp);
+    if (err == LP_OK) err = _lp_write_out_buff(lp);
+    if (err < 0 && err != LP_ERROR_WOULD_BLOCK) return err;
+  }
+
+  // Frames that write nothing say nothing about the frame size
+  if (lp->pace_bytes > 0)
+    lp->frame_bytes = (lp->frame_bytes == 0) ? lp->pace_bytes
+      : (3 * lp->frame_bytes + lp->pace_bytes) / 4;
+  lp->pace_bytes = 0;
+
+  double wait = lp_frame_interval(lp);
+  size_t rate = __atomic_load_n(&lp->out_rate, __ATOMIC_RELAXED);
+  if (rate > 0)
+  {
+    // Bytes still waiting to be sent delay the next frame
+    size_t backlog = 0;
+#ifdef LIBLAUNCHPAD_THREADED
+    if (lp->threaded)
+      for (int i = 0; i < LP_PRIORITIES; ++i)
+        backlog += lp->rings[i].head
+          - __atomic_load_n(&lp->rings[i].tail, __ATOMIC_ACQUIRE);
+    else
+#endif
+      backlog = _lp_out_queued(lp) + lp->unsent_size - lp->unsent_offset;
+    if (backlog > lp->frame_bytes)
+      wait += (double) (backlog - lp->frame_bytes) / rate;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double remaining = wait - _lp_elapsed(&lp->pace_time, &now);
+  if (remaining <= 0)
+  {
+    // Late, start counting from now instead of rushing to catch up
+    lp->pace_time = now;
+    return LP_OK;
+  }
+
+  struct timespec sleep_time = {
+    .tv_sec  = (time_t) remaining,
+    .tv_nsec = (long) ((remaining - (time_t) remaining) * 1e9),
+  };
+  while (nanosleep(&sleep_time, &sleep_time) < 0 && errno == EINTR);
+  clock_gettime(CLOCK_MONOTONIC, &lp->pace_time);
+
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int
+lp_set_double_buffering_flags(LP *lp, LPDoubleBufferingFlag flags)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_DOUBLE_BUFFERING))
+    return LP_ERROR_UNSUPPORTED;
+  
+  unsigned char msg_buff[LP_MESSAGE_SIZE];
+  size_t size = lp_encode_double_buffering_flags(msg_buff, flags);
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_swap_buffers(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_DOUBLE_BUFFERING))
+    return LP_ERROR_UNSUPPORTED;
+
+  if (lp->current_buff == 0)
+  {
+    lp->current_buff = 1;
+    return lp_set_double_buffering_flags(lp, LP_DOUBLE_BUFFERING_DISPLAY_1
+                                         | LP_DOUBLE_BUFFERING_UPDATE_0
+                                         | LP_DOUBLE_BUFFERING_COPY);
+  }
+  else
+  {
+    lp->current_buff = 0;
+    return lp_set_double_buffering_flags(lp, LP_DOUBLE_BUFFERING_DISPLAY_0
+                                         | LP_DOUBLE_BUFFERING_UPDATE_1
+                                         | LP_DOUBLE_BUFFERING_COPY);
+  }
+}
+  
+LIBLAUNCHPAD_DEF int lp_begin_frame(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  int shown = lp->current_buff;
+  int hidden = !shown;
+  bool same = _lp_buff_holds(lp, hidden, lp->shadow[shown]);
+  if (lp->update_buff == hidden && same) return LP_OK;
+
+  LPDoubleBufferingFlag flags = _lp_buffer_flags(shown, hidden);
+  if (!same) flags |= LP_DOUBLE_BUFFERING_COPY;
+  return lp_set_double_buffering_flags(lp, flags);
+}
+
+LIBLAUNCHPAD_DEF int lp_end_frame(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  // The buffer displayed until now is the next one drawn
+  int drawn = lp->update_buff;
+  return lp_set_double_buffering_flags(lp, _lp_buffer_flags(drawn, !drawn));
+}
+
+LIBLAUNCHPAD_DEF int lp_check_event(LP *lp, LPEvent *event)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  // Polling for events is a good time to close the coalescing window,
+  // and a blocking read could hold the notes until the next event
+  int err = (!lp->nonblocking_input && _lp_coalesced_left(lp) >= 0)
+    ? _lp_output(lp, NULL, 0) : _lp_check_coalesced(lp);
+  if (err < 0) return err;
+
+  unsigned char event_buff[3];
+  err = lp->transport->read(lp->transport_context, event_buff,
+                            sizeof(event_buff));
+  if (err == -EAGAIN) return 0; // nothing to read
+  if (err < 0) return LP_ERROR_MIDI_READ;
+  if (err == 3) {
+    unsigned char status = event_buff[0];
+    unsigned char note   = event_buff[1];
+    unsigned char velocity = event_buff[2];
+    
+    if (status == 0xB0 && note == 0 && velocity == 0x03)
+    {
+      if (event)
+      {
+        event->note_x = 0;
+        event->note_y = 0;
+        event->type = LP_EVENT_TEXT_SCROLLED;
+      }
+      return 1;
+    }
+
+    LPNoteKey key = LP_KEY_NONE;
+    if (status == 0x90) key = lp->layout_keys[note % LP_NOTES];
+    if (status == 0xB0) key = _lp_control_key(lp, note);
+    if (key == LP_KEY_NONE) return 0;
+
+    if (event && key < LP_KEY_AUTOMAP(0))
+    {
+      event->note_x = (key - (key / 16) * 16) % 9;
+      event->note_y = key / 16;
+      if (velocity > 0)
+      {
+        event->type = LP_EVENT_PRESSED;
+      }
+      else
+      {
+        event->type = LP_EVENT_RELEASED;
+      }
+    }
+    else if (event) {
+      event->note_x = key - LP_KEY_AUTOMAP(0);
+      event->note_y = 0;
+      if (velocity > 0)
+      {
+        event->type = LP_EVENT_AUTOMAP_PRESSED;
+      }
+      else
+      {
+        event->type = LP_EVENT_AUTOMAP_RELEASED;
+      }
+    }
+
+    return 1;
+  }
+  
+  return 0;
+}
+
+LIBLAUNCHPAD_DEF int lp_enable_flashing(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_FLASHING))
+    return LP_ERROR_UNSUPPORTED;
+
+  unsigned char msg_buff[LP_MESSAGE_SIZE];
+  size_t size = lp_encode_flashing(msg_buff, true);
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_disable_flashing(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_FLASHING))
+    return LP_ERROR_UNSUPPORTED;
+
+  unsigned char msg_buff[LP_MESSAGE_SIZE];
+  size_t size = lp_encode_flashing(msg_buff, false);
+  return _lp_write(lp, msg_buff, size);
+}
+  
+LIBLAUNCHPAD_DEF int lp_scroll_text(LP *lp, const char *text,
+                                    LPNoteColor color, unsigned char speed,
+                                    bool loop)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!text) return LP_ERROR_ARGUMENT_NULL;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_TEXT))
+    return LP_ERROR_UNSUPPORTED;
+  if (strlen(text) > LIBLAUNCHPAD_TEXT_SIZE) return LP_ERROR_UNSUPPORTED;
+
+  unsigned char msg_buff[LP_TEXT_MESSAGE_SIZE(LIBLAUNCHPAD_TEXT_SIZE)];
+  size_t size = lp_encode_text(msg_buff, text, color, speed, loop);
+  if (size == 0) return LP_ERROR_UNSUPPORTED;
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_set_duty_cycle(LP *lp, unsigned char numerator,
+                                       unsigned char denominator)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_DUTY_CYCLE))
+    return LP_ERROR_UNSUPPORTED;
+
+  unsigned char msg_buff[LP_MESSAGE_SIZE];
+  size_t size = lp_encode_duty_cycle(msg_buff, numerator, denominator);
+  if (size == 0) return LP_ERROR_UNSUPPORTED;
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_set_dimmer(LP *lp, double level)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_DUTY_CYCLE))
+    return LP_ERROR_UNSUPPORTED;
+
+  // The duty cycles go from 1 / 18 to the LEDs always on
+  double min = 1.0 / 18.0;
+  if (level < 0) level = 0;
+  if (level > 1) level = 1;
+  double target = min + level * (1.0 - min);
+
+  unsigned char numerator = 1, denominator = 18;
+  double best = 1.0;
+  for (unsigned char d = 3; d <= 18; ++d)
+    for (unsigned char n = 1; n <= 16 && n <= d; ++n)
+    {
+      double error = (double) n / d - target;
+      if (error < 0) error = -error;
+      if (error < best)
+      {
+        best = error;
+        numerator = n;
+        denominator = d;
+      }
+    }
+
+  if (numerator == lp->duty_numerator && denominator == lp->duty_denominator)
+    return LP_OK;
+  return lp_set_duty_cycle(lp, numerator, denominator);
+}
+
+LIBLAUNCHPAD_DEF int lp_set_blinking(LP *lp, LPNoteKey key,
+                                     LPNoteColor on, LPNoteColor off)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_FLASHING))
+    return LP_ERROR_UNSUPPORTED;
+
+  unsigned char msg_buff[4 * LP_MESSAGE_SIZE];
+  size_t size = 0;
+  if (!lp->flashing && (on & LP_COLOR_MASK) != (off & LP_COLOR_MASK))
+  {
+    // Every LED whose buffers differ starts blinking with the flashing,
+    // so the displayed buffer is copied over the other one first
+    int shown = lp->current_buff;
+    if (!_lp_buff_holds(lp, !shown, lp->shadow[shown]))
+      size += lp_encode_double_buffering_flags(msg_buff,
+                                               _lp_buffer_flags(shown, !shown)
+                                               | LP_DOUBLE_BUFFERING_COPY);
+    size += lp_encode_flashing(msg_buff + size, true);
+  }
+
+  // The device flashes by displaying one buffer then the other, so
+  // the LED blinks if the buffers hold different colors
+  on &= LP_COLOR_MASK;
+  off &= LP_COLOR_MASK;
+  if (on == off)
+  {
+    size += _lp_encode_note(lp, msg_buff + size,
+                            LP_NOTE(LP_NOTE_ON, key, on | LP_COLOR_FLAG_COPY));
+  }
+  else if (off == 0)
+  {
+    size += _lp_encode_note(lp, msg_buff + size,
+                            LP_NOTE(LP_NOTE_ON, key, on | LP_COLOR_FLAG_CLEAR));
+  }
+  else
+  {
+    size += _lp_encode_note(lp, msg_buff + size,
+                            LP_NOTE(LP_NOTE_ON, key, off | LP_COLOR_FLAG_COPY));
+    size += _lp_encode_note(lp, msg_buff + size, LP_NOTE(LP_NOTE_ON, key, on));
+  }
+
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_begin_batch(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  lp->batching = true;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_set_priority(LP *lp, LPPriority priority)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (priority < 0 || priority >= LP_PRIORITIES) return LP_ERROR_UNSUPPORTED;
+
+  // The notes held were set with the previous priority
+  if (lp->transport && priority != lp->priority)
+  {
+    int err = _lp_commit_coalesced(lp);
+    if (err < 0) return err;
+  }
+
+  lp->priority = priority;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_set_coalescing(LP *lp, unsigned int window)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  _lp_lock(lp);
+  lp->coalesce_window = window;
+  _lp_unlock(lp);
+  if (window > 0) return _lp_check_coalesced(lp);
+  return (_lp_coalesced_left(lp) >= 0) ? _lp_output(lp, NULL, 0) : LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_resume(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  // A batch is only written by `lp_flush`
+  if (lp->batching) return _lp_send_unsent(lp);
+
+  int err = _lp_write_out_buff(lp);
+  if (err != LP_OK || !lp->mailbox_full) return err;
+
+  // Everything before the latest frame went out, send it
+  err = _lp_commit_mailbox(lp);
+  if (err < 0) return err;
+  return _lp_write_out_buff(lp);
+}
+
+LIBLAUNCHPAD_DEF int
+lp_output_descriptors(LP *lp, struct pollfd *pfds, unsigned int space)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!pfds) return LP_ERROR_ARGUMENT_NULL;
+
+  int count = lp->transport->poll_descriptors(lp->transport_context, true,
+                                              pfds, space);
+  if (count < 0) return LP_ERROR_UNINITIALIZED;
+  return count;
+}
+
+LIBLAUNCHPAD_DEF int lp_flush(LP *lp, bool drain)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  lp->batching = false;
+  int err = _lp_commit_mailbox(lp);
+  if (err < 0) return err;
+  err = _lp_commit_coalesced(lp);
+  if (err < 0) return err;
+  err = _lp_write_out_buff(lp);
+  if (err < 0) return err;
+  // Nothing can be drained before `lp_resume` wrote everything
+  if (err == LP_PENDING) return err;
+
+#ifdef LIBLAUNCHPAD_THREADED
+  if (lp->threaded)
+  {
+    for (int i = 0; i < LP_PRIORITIES; ++i)
+      lp->flush_target[i] = lp->rings[i].head;
+    lp->flush_drain = drain;
+    __atomic_store_n(&lp->flush_pending, true, __ATOMIC_RELEASE);
+    sem_post(&lp->writer_sem);
+    while (sem_wait(&lp->flush_sem) < 0);
+
+    return __atomic_exchange_n(&lp->writer_error, LP_OK, __ATOMIC_ACQ_REL);
+  }
+#endif
+  if (drain) return _lp_drain(lp);
+
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_command_buffer_init(LPCommandBuffer *command_buffer,
+                                            unsigned char *buff,
+                                            size_t capacity)
+{
+  if (!command_buffer || !buff) return LP_ERROR_ARGUMENT_NULL;
+
+  command_buffer->buff = buff;
+  command_buffer->capacity = capacity;
+  command_buffer->size = 0;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_begin_record(LP *lp, LPCommandBuffer *command_buffer)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!command_buffer) return LP_ERROR_ARGUMENT_NULL;
+
+  lp->recording = command_buffer;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_end_record(LP *lp)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+
+  lp->recording = NULL;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int lp_replay(LP *lp, const LPCommandBuffer *command_buffer)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!command_buffer) return LP_ERROR_ARGUMENT_NULL;
+  if (command_buffer->size == 0) return LP_OK;
+  if (command_buffer->size > LIBLAUNCHPAD_OUT_BUFFER_SIZE)
+    return LP_ERROR_BUFFER_FULL;
+
+  return _lp_write(lp, command_buffer->buff, command_buffer->size);
+}
+
+LIBLAUNCHPAD_DEF int
+lp_add_page(LP *lp, const char *name, LPNoteColor frame[LP_LEDS])
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!name) return LP_ERROR_ARGUMENT_NULL;
+  if (strlen(name) >= LIBLAUNCHPAD_PAGE_NAME_SIZE)
+    return LP_ERROR_NAME_TOO_LONG;
+
+  for (int i = 0; i < LIBLAUNCHPAD_PAGES; ++i)
+  {
+    LPPage *page = &lp->pages[i];
+    if (page->used) continue;
+
+    page->used = true;
+    strcpy(page->name, name);
+    for (int j = 0; j < LP_LEDS; ++j)
+      page->frame[j] = frame ? (frame[j] & LP_COLOR_MASK) : 0;
+    _lp_encode_frame(lp, page->encoded, page->frame);
+    return i;
+  }
+
+  return LP_ERROR_PAGES_FULL;
+}
+
+LIBLAUNCHPAD_DEF int lp_find_page(LP *lp, const char *name)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (!name) return LP_ERROR_ARGUMENT_NULL;
+
+  for (int i = 0; i < LIBLAUNCHPAD_PAGES; ++i)
+    if (lp->pages[i].used && strcmp(lp->pages[i].name, name) == 0)
+      return i;
+
+  return LP_ERROR_NO_PAGE;
+}
+
+LIBLAUNCHPAD_DEF int lp_remove_page(LP *lp, int page)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (page < 0 || page >= LIBLAUNCHPAD_PAGES || !lp->pages[page].used)
+    return LP_ERROR_NO_PAGE;
+
+  lp->pages[page].used = false;
+  if (lp->active_page == page) lp->active_page = -1;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int
+lp_set_page_led(LP *lp, int page, int index, LPNoteColor color)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (page < 0 || page >= LIBLAUNCHPAD_PAGES || !lp->pages[page].used)
+    return LP_ERROR_NO_PAGE;
+  if (index < 0 || index >= LP_LEDS) return LP_ERROR_UNSUPPORTED;
+
+  // Patch the color in its rapid update message
+  color &= LP_COLOR_MASK;
+  lp->pages[page].frame[index] = color;
+  lp->pages[page].encoded[LP_MESSAGE_SIZE * (1 + index / 2) + 1 + index % 2]
+    = color;
+  if (page != lp->active_page) return LP_OK;
+
+  unsigned char msg_buff[LP_MESSAGE_SIZE];
+  size_t size = _lp_encode_note(lp, msg_buff,
+                                LP_NOTE(LP_NOTE_ON, _lp_index_key(index),
+                                        color));
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF int lp_show_page(LP *lp, int page)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+  if (!lp->transport) return LP_ERROR_UNINITIALIZED;
+  if (page < 0 || page >= LIBLAUNCHPAD_PAGES || !lp->pages[page].used)
+    return LP_ERROR_NO_PAGE;
+  if (!(lp->capabilities.flags & LP_CAPABILITY_RAPID_UPDATE)
+      || !(lp->capabilities.flags & LP_CAPABILITY_DOUBLE_BUFFERING))
+    return LP_ERROR_UNSUPPORTED;
+
+  LPPage *p = &lp->pages[page];
+  int shown = lp->current_buff;
+  int hidden = !shown;
+  unsigned char msg_buff[2 * LP_MESSAGE_SIZE + LP_FRAME_MESSAGE_SIZE];
+  size_t size = 0;
+
+  // Display the buffer holding the page, drawing the page in the
+  // hidden buffer if neither does
+  int target = shown;
+  if (!_lp_buff_holds(lp, shown, p->frame))
+  {
+    target = hidden;
+    if (!_lp_buff_holds(lp, hidden, p->frame))
+    {
+      if (lp->update_buff != hidden)
+        size += lp_encode_double_buffering_flags(msg_buff,
+                                                 _lp_buffer_flags(shown,
+                                                                  hidden));
+      memcpy(msg_buff + size, p->encoded, sizeof(p->encoded));
+      size += sizeof(p->encoded);
+    }
+  }
+  if (target != shown || lp->update_buff != target)
+    size += lp_encode_double_buffering_flags(msg_buff + size,
+                                             _lp_buffer_flags(target, target));
+
+  // The device shows the page only once the messages are written
+  int err = (size == 0) ? LP_OK : _lp_write(lp, msg_buff, size);
+  if (err >= 0) lp->active_page = page;
+  return err;
+}
+
+LIBLAUNCHPAD_DEF int
+lp_frame_cache_stats(LP *lp, size_t *hits, size_t *misses)
+{
+  if (!lp) return LP_ERROR_LP_NULL;
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+  if (hits) *hits = lp->frame_cache_hits;
+  if (misses) *misses = lp->frame_cache_misses;
+  return LP_OK;
+#else
+  (void) hits;
+  (void) misses;
+  return LP_ERROR_UNSUPPORTED;
+#endif
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_reset(unsigned char *buff)
+{
+  buff[0] = 0xB0;
+  buff[1] = 0;
+  buff[2] = 0;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_device_inquiry(unsigned char *buff)
+{
+  buff[0] = 0xF0;
+  buff[1] = 0x7E;
+  buff[2] = 0x7F;
+  buff[3] = 0x06;
+  buff[4] = 0x01;
+  buff[5] = 0xF7;
+  return LP_INQUIRY_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF bool
+lp_parse_device_inquiry(const unsigned char *buff, size_t size,
+                        LPCapabilities *capabilities)
+{
+  // F0 7E <channel> 06 02 <manufacturer> <family> <member> <version> F7
+  if (size != LP_INQUIRY_REPLY_SIZE || buff[0] != 0xF0 || buff[1] != 0x7E
+      || buff[3] != 0x06 || buff[4] != 0x02 || buff[16] != 0xF7)
+    return false;
+
+  capabilities->model = LP_MODEL_UNKNOWN;
+  capabilities->flags = LP_CAPABILITIES_LAUNCHPAD_S;
+  capabilities->firmware = 0;
+  // The firmware version is sent as four digits
+  for (int i = 12; i < 16; ++i)
+    capabilities->firmware = 10 * capabilities->firmware + buff[i] % 10;
+
+  bool novation = buff[5] == 0x00 && buff[6] == 0x20 && buff[7] == 0x29;
+  if (novation && buff[8] == 0x20) capabilities->model = LP_MODEL_LAUNCHPAD_S;
+  if (novation && buff[8] == 0x36)
+    capabilities->model = LP_MODEL_LAUNCHPAD_MINI;
+  if (novation && buff[8] == 0x69) capabilities->model = LP_MODEL_LAUNCHPAD_MK2;
+  if (novation && buff[8] == 0x51) capabilities->model = LP_MODEL_LAUNCHPAD_PRO;
+  if (_lp_rgb_device(capabilities->model) != 0)
+    capabilities->flags = LP_CAPABILITY_RGB;
+  return true;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_rgb(unsigned char *buff, LPModel model,
+                                      LPNoteColor frame[LP_LEDS])
+{
+  unsigned char device = _lp_rgb_device(model);
+  if (device == 0) return 0;
+
+  // F0 00 20 29 02 <device> 0B, then <led> <red> <green> <blue> for
+  // each LED, levels from 0 to 63
+  size_t size = 0;
+  buff[size++] = 0xF0;
+  buff[size++] = 0x00;
+  buff[size++] = 0x20;
+  buff[size++] = 0x29;
+  buff[size++] = 0x02;
+  buff[size++] = device;
+  buff[size++] = 0x0B;
+  for (int i = 0; i < LP_LEDS; ++i)
+  {
+    if (frame[i] == LP_COLOR_UNKNOWN) continue;
+    buff[size++] = _lp_rgb_led(model, i);
+    buff[size++] = 21 * (frame[i] % 0x10 % 4);
+    buff[size++] = 21 * (frame[i] / 0x10 % 4);
+    buff[size++] = 0;
+  }
+  if (size == 7) return 0;
+  buff[size++] = 0xF7;
+
+  return size;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_rgb_clear(unsigned char *buff,
+                                            LPModel model)
+{
+  unsigned char device = _lp_rgb_device(model);
+  if (device == 0) return 0;
+
+  // Set all the LEDs to the first color of the palette, which is off
+  buff[0] = 0xF0;
+  buff[1] = 0x00;
+  buff[2] = 0x20;
+  buff[3] = 0x29;
+  buff[4] = 0x02;
+  buff[5] = device;
+  buff[6] = 0x0E;
+  buff[7] = 0x00;
+  buff[8] = 0xF7;
+  return LP_RGB_CLEAR_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_layout(unsigned char *buff,
+                                         LPLayout layout)
+{
+  buff[0] = 0xB0;
+  buff[1] = 0;
+  buff[2] = layout;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_note(unsigned char *buff, LPNote note)
+{
+  if (note.key >= LP_KEY_AUTOMAP(0))
+    return lp_encode_automap(buff, note.key - LP_KEY_AUTOMAP(0),
+                             (note.state == LP_NOTE_ON) ? note.color : 0);
+  buff[0] = note.state;
+  buff[1] = note.key;
+  buff[2] = note.color;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t
+lp_encode_automap(unsigned char *buff, unsigned char col, LPNoteColor color)
+{
+  buff[0] = 0xB0;
+  buff[1] = 0x68 + col;
+  buff[2] = color;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_rapid_update(unsigned char *buff,
+                                               LPNoteColor first,
+                                               LPNoteColor second)
+{
+  buff[0] = LP_RAPID_UPDATE;
+  buff[1] = first;
+  buff[2] = second;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_test(unsigned char *buff,
+                                       LPNoteBrightness brightness)
+{
+  if (brightness == LP_BRIGHTNESS_OFF) return 0;
+  buff[0] = 0xB0;
+  buff[1] = 0;
+  buff[2] = 0x7C + brightness;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_frame(unsigned char *buff,
+                                        LPNoteColor frame[LP_LEDS])
+{
+  // Selecting the X-Y layout moves the rapid update cursor back to
+  // the first LED, then each message sets the next two LEDs
+  buff[0] = 0xB0;
+  buff[1] = 0;
+  buff[2] = 0x01;
+  size_t size = LP_MESSAGE_SIZE;
+  for (int i = 0; i < LP_LEDS / 2; ++i)
+    size += lp_encode_rapid_update(buff + size, frame[2 * i],
+                                   frame[2 * i + 1]);
+
+  return size;
+}
+
+LIBLAUNCHPAD_DEF size_t
+lp_encode_double_buffering_flags(unsigned char *buff,
+                                 LPDoubleBufferingFlag flags)
+{
+  buff[0] = 0xB0;
+  buff[1] = 0;
+  buff[2] = flags + 0x20;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_flashing(unsigned char *buff, bool enable)
+{
+  buff[0] = 0xB0;
+  buff[1] = 0;
+  buff[2] = enable ? 0x28 : 0x21;
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_text(unsigned char *buff, const char *text,
+                                       LPNoteColor color, unsigned char speed,
+                                       bool loop)
+{
+  if (speed > 7) return 0;
+
+  size_t size = 0;
+  buff[size++] = 0xF0;
+  buff[size++] = 0x00;
+  buff[size++] = 0x20;
+  buff[size++] = 0x29;
+  buff[size++] = 0x09;
+  // An empty text with no color and no loop stops scrolling
+  buff[size++] = (text[0] == '\0') ? 0x00
+    : (color & 0x3F) | (loop ? 0x40 : 0);
+  // Bytes from 1 to 7 in the text set the speed from there on
+  if (speed > 0 && text[0] != '\0') buff[size++] = speed;
+  for (const char *c = text; *c != '\0'; ++c)
+    buff[size++] = ((unsigned char) *c < 0x80) ? *c : '?';
+  buff[size++] = 0xF7;
+
+  return size;
+}
+
+LIBLAUNCHPAD_DEF size_t lp_encode_duty_cycle(unsigned char *buff,
+                                             unsigned char numerator,
+                                             unsigned char denominator)
+{
+  if (numerator < 1 || numerator > 16) return 0;
+  if (denominator < 3 || denominator > 18) return 0;
+
+  // Each controller covers half of the numerators
+  buff[0] = 0xB0;
+  if (numerator < 9)
+  {
+    buff[1] = 0x1E;
+    buff[2] = 0x10 * (numerator - 1) + (denominator - 3);
+  }
+  else
+  {
+    buff[1] = 0x1F;
+    buff[2] = 0x10 * (numerator - 9) + (denominator - 3);
+  }
+  return LP_MESSAGE_SIZE;
+}
+
+LIBLAUNCHPAD_DEF int _lp_write(LP *lp, const unsigned char *buff, size_t size)
+{
+  if (lp->recording) return _lp_record(lp, buff, size);
+
+  bool known = !_lp_lower_lanes_pending(lp);
+  int err = _lp_output(lp, buff, size);
+  // Messages that found no room were not written at all
+  if (err == LP_ERROR_WOULD_BLOCK) return err;
+
+  _lp_track(lp, buff, size, known);
+  lp->pace_bytes += size;
+  return err;
+}
+
+LIBLAUNCHPAD_DEF int
+_lp_record(LP *lp, const unsigned char *buff, size_t size)
+{
+  LPCommandBuffer *command_buffer = lp->recording;
+  // A recording is replayed with a single write of the output buffer
+  if (command_buffer->capacity - command_buffer->size < size
+      || command_buffer->size + size > LIBLAUNCHPAD_OUT_BUFFER_SIZE)
+    return LP_ERROR_BUFFER_FULL;
+
+  memcpy(command_buffer->buff + command_buffer->size, buff, size);
+  command_buffer->size += size;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int
+_lp_output(LP *lp, const unsigned char *buff, size_t size)
+{
+  int err = _lp_commit_mailbox(lp);
+  if (err < 0) return err;
+  err = _lp_commit_coalesced(lp);
+  if (err < 0) return err;
+  err = _lp_append(lp, lp->priority, buff, size);
+  if (err < 0) return err;
+  if (lp->batching) return LP_OK;
+
+  err = _lp_write_out_buff(lp);
+  if (err < 0) return err;
+  // Draining would block
+  if (lp->nonblocking_output) return err;
+#ifdef LIBLAUNCHPAD_THREADED
+  // The writer thread drains only when asked by `lp_flush`
+  if (lp->threaded) return LP_OK;
+#endif
+  return _lp_drain(lp);
+}
+
+LIBLAUNCHPAD_DEF int _lp_append(LP *lp, LPPriority lane,
+                                const unsigned char *buff, size_t size)
+{
+  unsigned char rgb_buff[LP_RGB_CLEAR_MESSAGE_SIZE
+                         + LP_RGB_MESSAGE_SIZE(LP_LEDS)];
+  if (lp->capabilities.flags & LP_CAPABILITY_RGB)
+  {
+    // The messages are tracked after being written, so the cursor is
+    // still where the messages before left it
+    size = _lp_encode_rgb_stream(lp, buff, size, lp->rapid_cursor,
+                                 rgb_buff);
+    buff = rgb_buff;
+  }
+
+  unsigned char *out_buff = lp->out_buff[lane];
+  size_t *out_size = &lp->out_size[lane];
+  // Messages that fit in the output buffer are written in one piece
+  if (*out_size + size > LIBLAUNCHPAD_OUT_BUFFER_SIZE
+      && (*out_size > 0 || lp->nonblocking_output))
+  {
+    int err = _lp_write_out_buff(lp);
+    if (err < 0) return err;
+    if (lp->nonblocking_output
+        && *out_size + size > LIBLAUNCHPAD_OUT_BUFFER_SIZE)
+      return LP_ERROR_WOULD_BLOCK;
+  }
+  while (size > 0)
+  {
+    if (*out_size == LIBLAUNCHPAD_OUT_BUFFER_SIZE)
+    {
+      int err = _lp_write_out_buff(lp);
+      if (err < 0) return err;
+    }
+    size_t chunk = LIBLAUNCHPAD_OUT_BUFFER_SIZE - *out_size;
+    if (chunk > size) chunk = size;
+    memcpy(out_buff + *out_size, buff, chunk);
+    *out_size += chunk;
+    buff += chunk;
+    size -= chunk;
+  }
+
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int _lp_write_out_buff(LP *lp)
+{
+  // Messages are never interleaved with the rest of a message
+  int err = _lp_send_unsent(lp);
+  if (err != LP_OK) return err;
+
+  for (int i = 0; i < LP_PRIORITIES; ++i)
+  {
+    if (lp->out_size[i] == 0) continue;
+#ifdef LIBLAUNCHPAD_THREADED
+    if (lp->threaded)
+    {
+      _lp_ring_push(&lp->rings[i], &lp->writer_sem,
+                    lp->out_buff[i], lp->out_size[i]);
+      lp->out_size[i] = 0;
+      continue;
+    }
+#endif
+    err = _lp_send(lp, lp->out_buff[i], lp->out_size[i]);
+    lp->out_size[i] = 0;
+    if (err < 0)
+    {
+      memset(lp->out_size, 0, sizeof(lp->out_size));
+      return err;
+    }
+    // The lower lanes wait for the device
+    if (err == LP_PENDING) return err;
+  }
+
+#ifdef LIBLAUNCHPAD_THREADED
+  if (lp->threaded)
+    return __atomic_exchange_n(&lp->writer_error, LP_OK, __ATOMIC_ACQ_REL);
+#endif
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int _lp_send(LP *lp, const unsigned char *buff, size_t size)
+{
+  unsigned char send_buff[LIBLAUNCHPAD_OUT_BUFFER_SIZE];
+  size_t send_size = 0;
+  for (size_t i = 0; i < size; ++i)
+  {
+    unsigned char byte = buff[i];
+    if (byte & 0x80)
+    {
+      if (byte == lp->running_status) continue;
+      // Only note on / off messages run, CC and sysex reset the status
+      lp->running_status = ((byte & 0xE0) == 0x80) ? byte : 0;
+    }
+    // Once the device stopped taking bytes, the rest waits in unsent
+    if (lp->unsent_size > 0)
+    {
+      lp->unsent[lp->unsent_size++] = byte;
+      continue;
+    }
+    send_buff[send_size++] = byte;
+    if (send_size < sizeof(send_buff) && i + 1 < size) continue;
+
+    ssize_t bytes = lp->transport->write(lp->transport_context,
+                                         send_buff, send_size);
+    if (bytes == -EAGAIN && lp->nonblocking_output) bytes = 0;
+    if (bytes < 0
+        || (bytes != (ssize_t) send_size && !lp->nonblocking_output))
+    {
+      // The device may have been left in the middle of a message
+      lp->running_status = 0;
+      return LP_ERROR_MIDI_WRITE;
+    }
+    if (bytes > 0) _lp_measure(lp, bytes);
+    lp->unsent_size = send_size - bytes;
+    lp->unsent_offset = 0;
+    memcpy(lp->unsent, send_buff + bytes, lp->unsent_size);
+    send_size = 0;
+  }
+
+  return (lp->unsent_size > 0) ? LP_PENDING : LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int _lp_send_unsent(LP *lp)
+{
+  if (lp->unsent_size == 0) return LP_OK;
+
+  ssize_t bytes = lp->transport->write(lp->transport_context,
+                                       lp->unsent + lp->unsent_offset,
+                                       lp->unsent_size - lp->unsent_offset);
+  if (bytes == -EAGAIN) return LP_PENDING;
+  if (bytes < 0)
+  {
+    lp->running_status = 0;
+    return LP_ERROR_MIDI_WRITE;
+  }
+  if (bytes > 0) _lp_measure(lp, bytes);
+  lp->unsent_offset += bytes;
+  if (lp->unsent_offset < lp->unsent_size) return LP_PENDING;
+
+  lp->unsent_size = 0;
+  lp->unsent_offset = 0;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF bool
+_lp_buff_holds(LP *lp, int buff, LPNoteColor frame[LP_LEDS])
+{
+  for (int i = 0; i < LP_LEDS; ++i)
+    if (frame[i] == LP_COLOR_UNKNOWN || lp->shadow[buff][i] != frame[i])
+      return false;
+  return true;
+}
+
+LIBLAUNCHPAD_DEF LPDoubleBufferingFlag _lp_buffer_flags(int display,
+                                                        int update)
+{
+  return (display ? LP_DOUBLE_BUFFERING_DISPLAY_1
+                  : LP_DOUBLE_BUFFERING_DISPLAY_0)
+    | (update ? LP_DOUBLE_BUFFERING_UPDATE_1 : LP_DOUBLE_BUFFERING_UPDATE_0);
+}
+
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_frame_cached(LP *lp, unsigned char *buff,
+                        LPNoteColor frame[LP_LEDS])
+{
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+  uint32_t hash = _lp_frame_hash(frame);
+  LPFrameCacheEntry *oldest = &lp->frame_cache[0];
+  for (int i = 0; i < LIBLAUNCHPAD_FRAME_CACHE_SIZE; ++i)
+  {
+    LPFrameCacheEntry *entry = &lp->frame_cache[i];
+    if (entry->last_use > 0 && entry->hash == hash
+        && memcmp(entry->frame, frame, sizeof(entry->frame)) == 0)
+    {
+      entry->last_use = ++lp->frame_cache_clock;
+      lp->frame_cache_hits++;
+      memcpy(buff, entry->encoded, sizeof(entry->encoded));
+      return sizeof(entry->encoded);
+    }
+    if (entry->last_use < oldest->last_use) oldest = entry;
+  }
+
+  lp->frame_cache_misses++;
+  size_t size = _lp_encode_frame(lp, buff, frame);
+  oldest->hash = hash;
+  oldest->last_use = ++lp->frame_cache_clock;
+  memcpy(oldest->frame, frame, sizeof(oldest->frame));
+  memcpy(oldest->encoded, buff, size);
+  return size;
+#else
+  return _lp_encode_frame(lp, buff, frame);
+#endif
+}
+
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+
+LIBLAUNCHPAD_DEF uint32_t _lp_frame_hash(LPNoteColor frame[LP_LEDS])
+{
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < LP_LEDS; ++i)
+  {
+    hash ^= frame[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+#endif // LIBLAUNCHPAD_FRAME_CACHE
+
+LIBLAUNCHPAD_DEF int _lp_commit_mailbox(LP *lp)
+{
+  unsigned char msg_buff[LP_FRAME_MESSAGE_SIZE];
+  size_t size = 0;
+  LPPriority lane = LP_PRIORITY_NORMAL;
+  _lp_lock(lp);
+  bool full = lp->mailbox_full;
+  if (full)
+  {
+    size = lp->mailbox_size;
+    lane = lp->mailbox_priority;
+    memcpy(msg_buff, lp->mailbox, size);
+  }
+  lp->mailbox_full = false;
+  _lp_unlock(lp);
+  if (!full) return LP_OK;
+
+  // The frame was tracked when it was submitted
+  int err = _lp_append(lp, lane, msg_buff, size);
+  // Only without the writer thread, so the frame is still there
+  if (err == LP_ERROR_WOULD_BLOCK) lp->mailbox_full = true;
+  return err;
+}
+
+LIBLAUNCHPAD_DEF int _lp_commit_coalesced(LP *lp)
+{
+  // The notes were tracked when they were set
+  unsigned char msg_buff[LP_MESSAGE_SIZE * LP_LEDS];
+  LPNoteColor held[LP_LEDS];
+  _lp_lock(lp);
+  memcpy(held, lp->coalesced, sizeof(held));
+  _lp_unlock(lp);
+  size_t size = _lp_take_coalesced(lp, msg_buff, false);
+  if (size == 0) return LP_OK;
+
+  int err = _lp_append(lp, lp->priority, msg_buff, size);
+  if (err < 0)
+  {
+    // Hold the notes again, only this thread sets them
+    _lp_lock(lp);
+    for (int i = 0; i < LP_LEDS; ++i)
     {
-      event->note_x = (note - (note / 16) * 16) % 9;
-      event->note_y = note / 16;
-      if (velocity > 0)
+      if (held[i] == LP_COLOR_UNKNOWN
+          || lp->coalesced[i] != LP_COLOR_UNKNOWN) continue;
+      lp->coalesced[i] = held[i];
+      lp->coalesced_count++;
+    }
+    _lp_unlock(lp);
+    return err;
+  }
+  lp->pace_bytes += size;
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF int _lp_check_coalesced(LP *lp)
+{
+  if (_lp_coalesced_left(lp) != 0) return LP_OK;
+  return _lp_output(lp, NULL, 0);
+}
+
+LIBLAUNCHPAD_DEF size_t
+_lp_take_coalesced(LP *lp, unsigned char *buff, bool expired)
+{
+  size_t size = 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  _lp_lock(lp);
+  if (lp->coalesced_count > 0
+      && (!expired || _lp_elapsed(&lp->coalesce_time, &now) * 1e6
+                      >= lp->coalesce_window))
+  {
+    for (int i = 0; i < LP_LEDS; ++i)
+    {
+      if (lp->coalesced[i] == LP_COLOR_UNKNOWN) continue;
+      size += _lp_encode_note(lp, buff + size,
+                              LP_NOTE(LP_NOTE_ON, _lp_index_key(i),
+                                      lp->coalesced[i]));
+    }
+    memset(lp->coalesced, LP_COLOR_UNKNOWN, sizeof(lp->coalesced));
+    lp->coalesced_count = 0;
+  }
+  _lp_unlock(lp);
+  return size;
+}
+
+LIBLAUNCHPAD_DEF long _lp_coalesced_left(LP *lp)
+{
+  long left = -1;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  _lp_lock(lp);
+  if (lp->coalesced_count > 0)
+  {
+    double elapsed = _lp_elapsed(&lp->coalesce_time, &now) * 1e6;
+    left = (elapsed < lp->coalesce_window)
+      ? (long) (lp->coalesce_window - elapsed) : 0;
+  }
+  _lp_unlock(lp);
+  return left;
+}
+
+LIBLAUNCHPAD_DEF void _lp_lock(LP *lp)
+{
+#ifdef LIBLAUNCHPAD_THREADED
+  if (lp->threaded) pthread_mutex_lock(&lp->mailbox_lock);
+#else
+  (void) lp;
+#endif
+}
+
+LIBLAUNCHPAD_DEF void _lp_unlock(LP *lp)
+{
+#ifdef LIBLAUNCHPAD_THREADED
+  if (lp->threaded) pthread_mutex_unlock(&lp->mailbox_lock);
+#else
+  (void) lp;
+#endif
+}
+
+LIBLAUNCHPAD_DEF size_t _lp_out_queued(LP *lp)
+{
+  if (!lp->transport->queued) return 0;
+  return lp->transport->queued(lp->transport_context);
+}
+
+LIBLAUNCHPAD_DEF int _lp_set_midi_params(LP *lp, const LPMidiParams *params)
+{
+  snd_rawmidi_params_t *midi_params;
+  memset(&lp->params, 0, sizeof(lp->params));
+  if (snd_rawmidi_params_malloc(&midi_params) < 0)
+    return LP_ERROR_MIDI_PARAMS;
+
+  int err = 0;
+  if (params->out_buffer_size > 0 || params->out_avail_min > 0
+      || params->no_active_sensing)
+  {
+    err = snd_rawmidi_params_current(lp->alsa.midi_out, midi_params);
+    if (err == 0 && params->out_buffer_size > 0)
+      err = snd_rawmidi_params_set_buffer_size(lp->alsa.midi_out, midi_params,
+                                               params->out_buffer_size);
+    if (err == 0 && params->out_avail_min > 0)
+      err = snd_rawmidi_params_set_avail_min(lp->alsa.midi_out, midi_params,
+                                             params->out_avail_min);
+    if (err == 0 && params->no_active_sensing)
+      err = snd_rawmidi_params_set_no_active_sensing(lp->alsa.midi_out,
+                                                     midi_params, 1);
+    if (err == 0) err = snd_rawmidi_params(lp->alsa.midi_out, midi_params);
+  }
+  if (err == 0 && params->in_buffer_size > 0)
+  {
+    err = snd_rawmidi_params_current(lp->alsa.midi_in, midi_params);
+    if (err == 0)
+      err = snd_rawmidi_params_set_buffer_size(lp->alsa.midi_in, midi_params,
+                                               params->in_buffer_size);
+    if (err == 0) err = snd_rawmidi_params(lp->alsa.midi_in, midi_params);
+  }
+
+  // The driver may have adjusted the values
+  if (snd_rawmidi_params_current(lp->alsa.midi_out, midi_params) == 0)
+  {
+    lp->params.out_buffer_size =
+      snd_rawmidi_params_get_buffer_size(midi_params);
+    lp->params.out_avail_min = snd_rawmidi_params_get_avail_min(midi_params);
+    lp->params.no_active_sensing =
+      snd_rawmidi_params_get_no_active_sensing(midi_params);
+  }
+  if (snd_rawmidi_params_current(lp->alsa.midi_in, midi_params) == 0)
+    lp->params.in_buffer_size = snd_rawmidi_params_get_buffer_size(midi_params);
+  snd_rawmidi_params_free(midi_params);
+  lp->alsa.out_buffer_size = lp->params.out_buffer_size;
+
+  return (err < 0) ? LP_ERROR_MIDI_PARAMS : LP_OK;
+}
+
+LIBLAUNCHPAD_DEF ssize_t
+_lp_alsa_write(void *context, const unsigned char *buff, size_t size)
+{
+  LPAlsaTransport *alsa = context;
+  return snd_rawmidi_write(alsa->midi_out, buff, size);
+}
+
+LIBLAUNCHPAD_DEF ssize_t
+_lp_alsa_read(void *context, unsigned char *buff, size_t size)
+{
+  LPAlsaTransport *alsa = context;
+  return snd_rawmidi_read(alsa->midi_in, buff, size);
+}
+
+LIBLAUNCHPAD_DEF int
+_lp_alsa_poll_descriptors(void *context, bool output,
+                          struct pollfd *pfds, unsigned int space)
+{
+  LPAlsaTransport *alsa = context;
+  return snd_rawmidi_poll_descriptors(output ? alsa->midi_out
+                                      : alsa->midi_in, pfds, space);
+}
+
+LIBLAUNCHPAD_DEF int
+_lp_alsa_set_nonblocking(void *context, bool output, bool nonblocking)
+{
+  LPAlsaTransport *alsa = context;
+  return snd_rawmidi_nonblock(output ? alsa->midi_out : alsa->midi_in,
+                              nonblocking);
+}
+
+LIBLAUNCHPAD_DEF int _lp_alsa_flush(void *context)
+{
+  LPAlsaTransport *alsa = context;
+  return snd_rawmidi_drain(alsa->midi_out);
+}
+
+LIBLAUNCHPAD_DEF size_t _lp_alsa_queued(void *context)
+{
+  LPAlsaTransport *alsa = context;
+  snd_rawmidi_status_t *status;
+  if (alsa->out_buffer_size == 0) return 0;
+  if (snd_rawmidi_status_malloc(&status) < 0) return 0;
+
+  size_t queued = 0;
+  if (snd_rawmidi_status(alsa->midi_out, status) == 0)
+  {
+    size_t avail = snd_rawmidi_status_get_avail(status);
+    if (avail < alsa->out_buffer_size)
+      queued = alsa->out_buffer_size - avail;
+  }
+  snd_rawmidi_status_free(status);
+
+  return queued;
+}
+
+LIBLAUNCHPAD_DEF int _lp_alsa_close(void *context)
+{
+  LPAlsaTransport *alsa = context;
+  int in_err = snd_rawmidi_close(alsa->midi_in);
+  int out_err = snd_rawmidi_close(alsa->midi_out);
+  return (in_err < 0) ? in_err : out_err;
+}
+
+LIBLAUNCHPAD_DEF int _lp_drain(LP *lp)
+{
+  struct timespec start, end;
+  size_t queued = _lp_out_queued(lp);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (lp->transport->flush(lp->transport_context) < 0)
+    return LP_ERROR_MIDI_DRAIN;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  // The device was busy with the queued bytes for the whole drain
+  if (queued > 0) _lp_rate_sample(lp, queued, _lp_elapsed(&start, &end));
+  lp->rate_time = end;
+  lp->rate_queued = 0;
+  lp->rate_sent = 0;
+
+  return LP_OK;
+}
+
+LIBLAUNCHPAD_DEF void _lp_measure(LP *lp, size_t sent)
+{
+  lp->rate_sent += sent;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = _lp_elapsed(&lp->rate_time, &now);
+  // Too short to be measured reliably
+  if (elapsed < 0.005) return;
+
+  size_t queued = _lp_out_queued(lp);
+  size_t drained = 0;
+  if (lp->rate_queued + lp->rate_sent > queued)
+    drained = lp->rate_queued + lp->rate_sent - queued;
+
+  // If the queue ran empty the device was idle for some time, so the
+  // sample only says that the device is at least this fast
+  size_t rate = __atomic_load_n(&lp->out_rate, __ATOMIC_RELAXED);
+  if ((lp->rate_queued > 0 && queued > 0) || drained / elapsed > rate)
+    _lp_rate_sample(lp, drained, elapsed);
+
+  lp->rate_time = now;
+  lp->rate_queued = queued;
+  lp->rate_sent = 0;
+}
+
+LIBLAUNCHPAD_DEF void _lp_rate_sample(LP *lp, size_t bytes, double seconds)
+{
+  if (seconds <= 0) return;
+  size_t sample = (size_t) (bytes / seconds);
+  size_t rate = __atomic_load_n(&lp->out_rate, __ATOMIC_RELAXED);
+  rate = (rate == 0) ? sample : (7 * rate + sample) / 8;
+  __atomic_store_n(&lp->out_rate, rate, __ATOMIC_RELAXED);
+}
+
+LIBLAUNCHPAD_DEF double _lp_elapsed(const struct timespec *from,
+                                    const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+#ifdef LIBLAUNCHPAD_THREADED
+
+LIBLAUNCHPAD_DEF void _lp_ring_push(LPRing *ring, sem_t *consumer,
+                                    const unsigned char *buff, size_t size)
+{
+  size_t head = ring->head;
+  while (size > 0)
+  {
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t space = LIBLAUNCHPAD_RING_SIZE - (head - tail);
+    if (space == 0)
+    {
+      // The consumer is behind, give it some time
+      sched_yield();
+      continue;
+    }
+
+    size_t offset = head & (LIBLAUNCHPAD_RING_SIZE - 1);
+    size_t chunk = LIBLAUNCHPAD_RING_SIZE - offset;
+    if (chunk > space) chunk = space;
+    if (chunk > size) chunk = size;
+    memcpy(ring->buff + offset, buff, chunk);
+    buff += chunk;
+    size -= chunk;
+    head += chunk;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    sem_post(consumer);
+  }
+}
+
+LIBLAUNCHPAD_DEF size_t
+_lp_ring_peek(LPRing *ring, unsigned char *buff, size_t size)
+{
+  size_t tail = ring->tail;
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  size_t count = 0;
+  while (tail + count != head)
+  {
+    unsigned char byte
+      = ring->buff[(tail + count) & (LIBLAUNCHPAD_RING_SIZE - 1)];
+    // A rapid update continues the run of the previous message, which
+    // would restart from the first LED if interrupted, and the end of
+    // a sysex message is part of it
+    if (count >= size && (byte & 0x80) && byte != LP_RAPID_UPDATE
+        && byte != 0xF7)
+      break;
+    buff[count++] = byte;
+  }
+
+  return count;
+}
+
+LIBLAUNCHPAD_DEF void *_lp_writer(void *arg)
+{
+  LP *lp = arg;
+  unsigned char chunk_buff[LIBLAUNCHPAD_RING_SIZE];
+  bool stop = false;
+  while (!stop)
+  {
+    // While notes are held, wake up in time to close their window
+    long left = _lp_coalesced_left(lp);
+    if (left < 0)
+      while (sem_wait(&lp->writer_sem) < 0);
+    else if (left > 0 && sem_trywait(&lp->writer_sem) < 0)
+    {
+      if (left > LIBLAUNCHPAD_WRITER_SLICE) left = LIBLAUNCHPAD_WRITER_SLICE;
+      struct timespec sleep_time = { 0, left * 1000 };
+      nanosleep(&sleep_time, NULL);
+    }
+    stop = __atomic_load_n(&lp->writer_stop, __ATOMIC_SEQ_CST);
+
+    unsigned char msg_buff[LP_FRAME_MESSAGE_SIZE];
+    size_t size = 0;
+    bool full = false;
+    for (bool empty = false; !empty;)
+    {
+      // Always write from the highest priority lane with messages, the
+      // interactive lane all at once and the others a chunk at a time,
+      // waiting for each chunk to be sent before looking again
+      for (int lane = 0; lane < LP_PRIORITIES; ++lane)
       {
-        event->type = LP_EVENT_PRESSED;
+        LPRing *ring = &lp->rings[lane];
+        size_t size = (lane == LP_PRIORITY_INTERACTIVE)
+          ? LIBLAUNCHPAD_RING_SIZE : LIBLAUNCHPAD_LANE_CHUNK;
+        size_t chunk = _lp_ring_peek(ring, chunk_buff, size);
+        if (chunk == 0) continue;
+
+        int err = _lp_send(lp, chunk_buff, chunk);
+        if (err == LP_OK && lane != LP_PRIORITY_INTERACTIVE)
+          err = _lp_drain(lp);
+        if (err < 0)
+        {
+          // Drop what is queued, the device is in an unknown state
+          __atomic_store_n(&lp->writer_error, err, __ATOMIC_RELEASE);
+          chunk = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+            - ring->tail;
+        }
+        __atomic_store_n(&ring->tail, ring->tail + chunk, __ATOMIC_RELEASE);
+        lane = -1;
       }
-      else
+
+      // A frame in the mailbox was submitted after everything in the
+      // rings, as the producer moves it to a ring before writing more.
+      // Messages pushed since the rings were found empty were written
+      // before the frame, so they are sent first. Waiting for the
+      // frame to be sent keeps newer frames in the mailbox.
+      pthread_mutex_lock(&lp->mailbox_lock);
+      empty = true;
+      for (int i = 0; empty && i < LP_PRIORITIES; ++i)
+        empty = __atomic_load_n(&lp->rings[i].head, __ATOMIC_ACQUIRE)
+          == lp->rings[i].tail;
+      full = empty && lp->mailbox_full;
+      if (full)
       {
-        event->type = LP_EVENT_RELEASED;
+        size = lp->mailbox_size;
+        memcpy(msg_buff, lp->mailbox, size);
+        lp->mailbox_full = false;
       }
+      pthread_mutex_unlock(&lp->mailbox_lock);
     }
-    else if (event && status == 0xB0) {
-      event->note_x = note - 0x68;
-      event->note_y = 0;
-      if (velocity > 0)
+    if (full)
+    {
+      unsigned char rgb_buff[LP_RGB_CLEAR_MESSAGE_SIZE
+                             + LP_RGB_MESSAGE_SIZE(LP_LEDS)];
+      unsigned char *send_buff = msg_buff;
+      if (lp->capabilities.flags & LP_CAPABILITY_RGB)
       {
-        event->type = LP_EVENT_AUTOMAP_PRESSED;
+        size = _lp_encode_rgb_stream(lp, msg_buff, size, 0, rgb_buff);
+        send_buff = rgb_buff;
       }
-      else
+      int err = _lp_send(lp, send_buff, size);
+      if (err == LP_OK) err = _lp_drain(lp);
+      if (err < 0)
+        __atomic_store_n(&lp->writer_error, err, __ATOMIC_RELEASE);
+    }
+
+    // Notes held past their window were set after the frame, as the
+    // producer moves them to a ring before submitting a frame
+    unsigned char notes_buff[LP_MESSAGE_SIZE * LP_LEDS];
+    size = _lp_take_coalesced(lp, notes_buff, true);
+    if (size > 0)
+    {
+      unsigned char rgb_buff[LP_RGB_CLEAR_MESSAGE_SIZE
+                             + LP_RGB_MESSAGE_SIZE(LP_LEDS)];
+      unsigned char *send_buff = notes_buff;
+      if (lp->capabilities.flags & LP_CAPABILITY_RGB)
       {
-        event->type = LP_EVENT_AUTOMAP_RELEASED;
+        size = _lp_encode_rgb_stream(lp, notes_buff, size, 0, rgb_buff);
+        send_buff = rgb_buff;
       }
+      int err = _lp_send(lp, send_buff, size);
+      if (err < 0)
+        __atomic_store_n(&lp->writer_error, err, __ATOMIC_RELEASE);
     }
 
-    return 1;
+    // The flush targets may have been queued after the rings were
+    // found empty, then the flush is completed after the next wake up
+    bool flushed = __atomic_load_n(&lp->flush_pending, __ATOMIC_ACQUIRE);
+    for (int i = 0; flushed && i < LP_PRIORITIES; ++i)
+      flushed = lp->rings[i].tail >= lp->flush_target[i];
+    if (flushed)
+    {
+      int err = lp->flush_drain ? _lp_drain(lp) : LP_OK;
+      if (err < 0)
+        __atomic_store_n(&lp->writer_error, err, __ATOMIC_RELEASE);
+      __atomic_store_n(&lp->flush_pending, false, __ATOMIC_RELEASE);
+      sem_post(&lp->flush_sem);
+    }
   }
-  
-  return 0;
+
+  return NULL;
 }
 
-LIBLAUNCHPAD_DEF int lp_enable_flashing(LP *lp)
+#endif // LIBLAUNCHPAD_THREADED
+
+LIBLAUNCHPAD_DEF void _lp_track(LP *lp, const unsigned char *buff,
+                                size_t size, bool known)
 {
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_out) return LP_ERROR_UNINITIALIZED;
+  unsigned char status = 0;
+  size_t i = 0;
+  while (i < size)
+  {
+    if (buff[i] & 0x80) status = buff[i++];
+    if (status == 0xF0)
+    {
+      // Scrolling text draws over the grid, other sysex messages do
+      // not change the LEDs
+      if (i + 4 <= size && buff[i] == 0x00 && buff[i + 1] == 0x20
+          && buff[i + 2] == 0x29 && buff[i + 3] == 0x09)
+        for (int j = 0; j < LP_ROWS * LP_COLS; ++j)
+          _lp_track_led(lp, j, 0, false);
+      while (i < size && buff[i] != 0xF7) i++;
+      i++;
+      status = 0;
+      continue;
+    }
+    if (i + 2 > size) break;
+    unsigned char data1 = buff[i];
+    unsigned char data2 = buff[i + 1];
+    i += 2;
 
-  unsigned char msg_buff[3] = { 0xB0, 0, 0x28 };
-  size_t bytes = snd_rawmidi_write(lp->midi_out, msg_buff, sizeof(msg_buff));
-  if (bytes != 3) return LP_ERROR_MIDI_WRITE;
-  if (snd_rawmidi_drain(lp->midi_out) < 0) return LP_ERROR_MIDI_DRAIN;
+    if (status == LP_RAPID_UPDATE)
+    {
+      if (lp->rapid_cursor < LP_LEDS)
+        _lp_track_led(lp, lp->rapid_cursor, data1, known);
+      if (lp->rapid_cursor + 1 < LP_LEDS)
+        _lp_track_led(lp, lp->rapid_cursor + 1, data2, known);
+      lp->rapid_cursor += 2;
+      continue;
+    }
+    // Any other message starts rapid updates from the first LED
+    lp->rapid_cursor = 0;
 
-  return LP_OK;
+    if (status == LP_NOTE_ON || status == LP_NOTE_OFF)
+    {
+      int index = _lp_key_index(lp->layout_keys[data1 % LP_NOTES]);
+      if (index >= 0)
+        _lp_track_led(lp, index, (status == LP_NOTE_ON) ? data2 : 0, known);
+    }
+    else if (status == 0xB0 && data1 >= 0x68 && data1 < 0x68 + LP_COLS)
+    {
+      _lp_track_led(lp, LP_FRAME_AUTOMAP(data1 - 0x68), data2, known);
+    }
+    else if (status == 0xB0 && data1 == 0 && (data2 == 0 || data2 >= 0x7D))
+    {
+      // Reset, the test commands then turn all the LEDs yellow
+      memset(lp->shadow, 0, sizeof(lp->shadow));
+      lp->current_buff = 0;
+      lp->update_buff = 0;
+      lp->flashing = false;
+      lp->duty_numerator = 1;
+      lp->duty_denominator = 5;
+      if (data2 != 0)
+      {
+        LPNoteBrightness brightness = data2 - 0x7C;
+        memset(lp->shadow[0], LP_COLOR(brightness, brightness, 0),
+               sizeof(lp->shadow[0]));
+        memset(lp->shadow[1], LP_COLOR_UNKNOWN, sizeof(lp->shadow[1]));
+      }
+    }
+    else if (status == 0xB0 && (data1 == 0x1E || data1 == 0x1F))
+    {
+      lp->duty_numerator = (data1 == 0x1E ? 1 : 9) + data2 / 0x10;
+      lp->duty_denominator = 3 + data2 % 0x10;
+    }
+    else if (status == 0xB0 && data1 == 0 && data2 >= 0x20 && data2 < 0x40)
+    {
+      LPDoubleBufferingFlag flags = data2 - 0x20;
+      lp->current_buff = flags & LP_DOUBLE_BUFFERING_DISPLAY_1;
+      lp->update_buff = (flags & LP_DOUBLE_BUFFERING_UPDATE_1) ? 1 : 0;
+      lp->flashing = (flags & LP_DOUBLE_BUFFERING_FLASH) != 0;
+      if ((flags & LP_DOUBLE_BUFFERING_COPY)
+          && lp->update_buff != lp->current_buff)
+        memcpy(lp->shadow[lp->update_buff], lp->shadow[lp->current_buff],
+               sizeof(lp->shadow[0]));
+    }
+  }
 }
 
-LIBLAUNCHPAD_DEF int lp_disable_flashing(LP *lp)
+LIBLAUNCHPAD_DEF void _lp_track_led(LP *lp, int index, LPNoteColor color,
+                                    bool known)
 {
-  if (!lp) return LP_ERROR_LP_NULL;
-  if (!lp->midi_out) return LP_ERROR_UNINITIALIZED;
+  int other_buff = !lp->update_buff;
+  if (!known)
+  {
+    lp->shadow[0][index] = LP_COLOR_UNKNOWN;
+    lp->shadow[1][index] = LP_COLOR_UNKNOWN;
+    return;
+  }
+  lp->shadow[lp->update_buff][index] = color & LP_COLOR_MASK;
+  if (color & LP_COLOR_FLAG_COPY)
+    lp->shadow[other_buff][index] = color & LP_COLOR_MASK;
+  else if (color & LP_COLOR_FLAG_CLEAR)
+    lp->shadow[other_buff][index] = 0;
+}
+
+LIBLAUNCHPAD_DEF bool _lp_lower_lanes_pending(LP *lp)
+{
+  for (int i = lp->priority + 1; i < LP_PRIORITIES; ++i)
+  {
+    if (lp->out_size[i] > 0) return true;
+#ifdef LIBLAUNCHPAD_THREADED
+    if (lp->threaded
+        && __atomic_load_n(&lp->rings[i].tail, __ATOMIC_ACQUIRE)
+           != lp->rings[i].head)
+      return true;
+#endif
+  }
 
-  unsigned char msg_buff[3] = { 0xB0, 0, 0x21 };
-  size_t bytes = snd_rawmidi_write(lp->midi_out, msg_buff, sizeof(msg_buff));
-  if (bytes != 3) return LP_ERROR_MIDI_WRITE;
-  if (snd_rawmidi_drain(lp->midi_out) < 0) return LP_ERROR_MIDI_DRAIN;
+  return false;
+}
 
-  return LP_OK;
+LIBLAUNCHPAD_DEF int _lp_draw(LP *lp, LPNoteColor frame[LP_LEDS],
+                              bool commands)
+{
+  // The LEDs left alone keep what the library knows of them, a rapid
+  // update can only be sent if all of them are known
+  LPNoteColor full[LP_LEDS];
+  bool changed[LP_LEDS];
+  bool complete = true;
+  int notes = 0, automaps = 0;
+  for (int i = 0; i < LP_LEDS; ++i)
+  {
+    full[i] = frame[i];
+    if (frame[i] == LP_COLOR_UNKNOWN)
+    {
+      full[i] = lp->shadow[lp->update_buff][i];
+      // What the device shows when replaying is not known
+      if (full[i] == LP_COLOR_UNKNOWN || lp->recording) complete = false;
+      changed[i] = false;
+      continue;
+    }
+    changed[i] = lp->recording || _lp_led_changed(lp, i, frame[i]);
+    if (!changed[i]) continue;
+    if (i < LP_FRAME_AUTOMAP(0)) notes++;
+    else automaps++;
+  }
+  if (notes + automaps == 0) return LP_OK;
+
+  // Note messages share their status byte, Automap LEDs are set with
+  // control changes, while a rapid update always costs the same
+  size_t notes_cost = 3 * automaps;
+  if (notes > 0)
+    notes_cost += 2 * notes + 1;
+
+  unsigned char msg_buff[LP_MESSAGE_SIZE * LP_LEDS];
+  size_t size = 0;
+  if (commands && complete && !lp->recording)
+    size = _lp_encode_fill_command(lp, msg_buff, full);
+  if (size > 0 && size < notes_cost) return _lp_write(lp, msg_buff, size);
+  size = 0;
+  if (complete && notes_cost >= 4 + LP_LEDS
+      && (lp->capabilities.flags & LP_CAPABILITY_RAPID_UPDATE))
+    return lp_set_frame(lp, full);
+
+  for (int i = 0; i < LP_LEDS; ++i)
+    if (changed[i])
+      size += _lp_encode_note(lp, msg_buff + size,
+                              LP_NOTE(LP_NOTE_ON, _lp_index_key(i),
+                                      frame[i]));
+
+  return _lp_write(lp, msg_buff, size);
+}
+
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_fill_command(LP *lp, unsigned char *buff,
+                        LPNoteColor frame[LP_LEDS])
+{
+  // Both commands reset the device, which must not show
+  if (lp->current_buff != 0 || lp->update_buff != 0 || lp->flashing
+      || lp->duty_numerator != 1 || lp->duty_denominator != 5)
+    return 0;
+  for (int i = 1; i < LP_LEDS; ++i)
+    if (frame[i] != frame[0]) return 0;
+
+  // Off is also what a reset leaves in the other buffer, whatever the
+  // flags, while the test commands do not say and RGB models have none
+  size_t size;
+  if ((frame[0] & LP_COLOR_MASK) == 0) size = lp_encode_reset(buff);
+  else if (lp->capabilities.flags & LP_CAPABILITY_RGB) return 0;
+  else if (frame[0] == LP_COLOR_YELLOW_LOW)
+    size = lp_encode_test(buff, LP_BRIGHTNESS_LOW);
+  else if (frame[0] == LP_COLOR_YELLOW_MEDIUM)
+    size = lp_encode_test(buff, LP_BRIGHTNESS_MEDIUM);
+  else if (frame[0] == LP_COLOR_YELLOW_FULL)
+    size = lp_encode_test(buff, LP_BRIGHTNESS_FULL);
+  else return 0;
+
+  // Both commands also select the X-Y layout
+  if (lp->layout != LP_LAYOUT_XY)
+    size += lp_encode_layout(buff + size, lp->layout);
+  return size;
+}
+
+LIBLAUNCHPAD_DEF bool _lp_led_changed(LP *lp, int index, LPNoteColor color)
+{
+  int other_buff = !lp->update_buff;
+  if (lp->shadow[lp->update_buff][index] != (color & LP_COLOR_MASK))
+    return true;
+  if (color & LP_COLOR_FLAG_COPY)
+    return lp->shadow[other_buff][index] != (color & LP_COLOR_MASK);
+  if (color & LP_COLOR_FLAG_CLEAR)
+    return lp->shadow[other_buff][index] != 0;
+  return false;
+}
+
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_note(LP *lp, unsigned char *buff, LPNote note)
+{
+  if (note.key < LP_NOTES) note.key = lp->layout_notes[note.key];
+  return lp_encode_note(buff, note);
+}
+
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_frame(LP *lp, unsigned char *buff, LPNoteColor frame[LP_LEDS])
+{
+  size_t size = lp_encode_frame(buff, frame);
+  lp_encode_layout(buff, lp->layout);
+  return size;
+}
+
+LIBLAUNCHPAD_DEF size_t
+_lp_encode_rgb_stream(LP *lp, const unsigned char *buff, size_t size,
+                      int cursor, unsigned char *rgb_buff)
+{
+  LPNoteColor frame[LP_LEDS];
+  memset(frame, LP_COLOR_UNKNOWN, sizeof(frame));
+  bool clear = false;
+  unsigned char status = 0;
+  size_t i = 0;
+  while (i < size)
+  {
+    if (buff[i] & 0x80) status = buff[i++];
+    if (status == 0xF0)
+    {
+      while (i < size && buff[i] != 0xF7) i++;
+      i++;
+      status = 0;
+      continue;
+    }
+    if (i + 2 > size) break;
+    unsigned char data1 = buff[i];
+    unsigned char data2 = buff[i + 1];
+    i += 2;
+
+    if (status == LP_RAPID_UPDATE)
+    {
+      if (cursor < LP_LEDS) frame[cursor] = data1 & LP_COLOR_MASK;
+      if (cursor + 1 < LP_LEDS) frame[cursor + 1] = data2 & LP_COLOR_MASK;
+      cursor += 2;
+      continue;
+    }
+    cursor = 0;
+
+    if (status == LP_NOTE_ON || status == LP_NOTE_OFF)
+    {
+      int index = _lp_key_index(lp->layout_keys[data1 % LP_NOTES]);
+      if (index >= 0)
+        frame[index] = (status == LP_NOTE_ON) ? data2 & LP_COLOR_MASK : 0;
+    }
+    else if (status == 0xB0 && data1 >= 0x68 && data1 < 0x68 + LP_COLS)
+    {
+      frame[LP_FRAME_AUTOMAP(data1 - 0x68)] = data2 & LP_COLOR_MASK;
+    }
+    else if (status == 0xB0 && data1 == 0 && data2 == 0)
+    {
+      // What was set before the reset does not show
+      memset(frame, LP_COLOR_UNKNOWN, sizeof(frame));
+      clear = true;
+    }
+  }
+
+  size_t rgb_size = 0;
+  if (clear)
+    rgb_size += lp_encode_rgb_clear(rgb_buff, lp->capabilities.model);
+  rgb_size += lp_encode_rgb(rgb_buff + rgb_size, lp->capabilities.model,
+                            frame);
+  return rgb_size;
+}
+
+LIBLAUNCHPAD_DEF unsigned char _lp_rgb_device(LPModel model)
+{
+  switch (model)
+  {
+  case LP_MODEL_LAUNCHPAD_MK2: return 0x18;
+  case LP_MODEL_LAUNCHPAD_PRO: return 0x10;
+  default: return 0;
+  }
+}
+
+LIBLAUNCHPAD_DEF unsigned char _lp_rgb_led(LPModel model, int index)
+{
+  // Rows count up from 1 at the bottom, in tens, and the Automap row
+  // starts at 104 on the MK2 and is the row above the grid on the Pro
+  int automap = (model == LP_MODEL_LAUNCHPAD_PRO) ? 91 : 104;
+  if (index >= LP_FRAME_AUTOMAP(0))
+    return automap + index - LP_FRAME_AUTOMAP(0);
+  if (index >= LP_FRAME_SCENE(0))
+    return 10 * (LP_ROWS - index + LP_FRAME_SCENE(0)) + LP_COLS + 1;
+  return 10 * (LP_ROWS - index / LP_COLS) + index % LP_COLS + 1;
+}
+
+LIBLAUNCHPAD_DEF void _lp_init_layout(LP *lp)
+{
+  memset(lp->layout_keys, LP_KEY_NONE, sizeof(lp->layout_keys));
+  for (int key = 0; key < LP_NOTES; ++key)
+  {
+    int row = key / 0x10;
+    int col = key % 0x10;
+    int note = key;
+    if (lp->capabilities.flags & LP_CAPABILITY_RGB)
+      note = (col <= LP_COLS)
+        ? _lp_rgb_led(lp->capabilities.model, _lp_key_index(key)) : 0;
+    else if (lp->layout == LP_LAYOUT_DRUM_RACK)
+    {
+      // Notes start from 36 at the bottom left, going up through the
+      // left and then the right half of the grid four notes per row,
+      // then up through the scene launch column. Note 0 is not on
+      // the device.
+      if (col < LP_COLS / 2)
+        note = 36 + 4 * (LP_ROWS - 1 - row) + col;
+      else if (col < LP_COLS)
+        note = 68 + 4 * (LP_ROWS - 1 - row) + col - LP_COLS / 2;
+      else if (col == LP_COLS)
+        note = 100 + LP_ROWS - 1 - row;
+      else
+        note = 0;
+    }
+    lp->layout_notes[key] = note;
+    if (col <= LP_COLS) lp->layout_keys[note] = key;
+  }
+}
+
+LIBLAUNCHPAD_DEF LPNoteKey _lp_control_key(LP *lp, unsigned char control)
+{
+  // All the round buttons of the Pro send control changes numbered
+  // like its LEDs, and the Automap row is the only one of the others
+  if (lp->capabilities.model == LP_MODEL_LAUNCHPAD_PRO)
+  {
+    if (control >= 91 && control < 91 + LP_COLS)
+      return LP_KEY_AUTOMAP(control - 91);
+    int row = LP_ROWS - control / 10;
+    if (control >= 19 && control <= 89 && control % 10 == 9)
+      return LP_KEY(row, LP_COLS);
+    return LP_KEY_NONE;
+  }
+  if (control >= 0x68 && control < 0x68 + LP_COLS)
+    return LP_KEY_AUTOMAP(control - 0x68);
+  return LP_KEY_NONE;
+}
+
+LIBLAUNCHPAD_DEF int _lp_probe(LP *lp, LPCapabilities *capabilities)
+{
+  unsigned char msg_buff[LP_INQUIRY_MESSAGE_SIZE];
+  size_t size = lp_encode_device_inquiry(msg_buff);
+  int err = _lp_write(lp, msg_buff, size);
+  if (err < 0) return err;
+
+  // The original Launchpad never replies, text scrolling came with
+  // the Launchpad S
+  *capabilities = (LPCapabilities){ LP_MODEL_LAUNCHPAD, 0,
+                                    LP_CAPABILITIES_LAUNCHPAD_S
+                                    & ~LP_CAPABILITY_TEXT };
+
+  struct pollfd pfds[4];
+  if (lp->transport->set_nonblocking(lp->transport_context, false, true) < 0)
+    return LP_ERROR_OPENING_LAUNCHPAD;
+  int count = lp->transport->poll_descriptors(lp->transport_context, false,
+                                              pfds, 4);
+  if (count < 0) return LP_ERROR_MIDI_READ;
+  unsigned char reply[LP_INQUIRY_REPLY_SIZE];
+  size_t reply_size = 0;
+  bool in_sysex = false;
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;;)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int left = LIBLAUNCHPAD_PROBE_TIMEOUT
+      - (int) (1000 * _lp_elapsed(&start, &now));
+    if (left <= 0) return LP_OK;
+    // Transports without descriptors are read every millisecond
+    if (count == 0) poll(NULL, 0, 1);
+    else if (poll(pfds, count, left) <= 0) continue;
+
+    unsigned char buff[64];
+    ssize_t read = lp->transport->read(lp->transport_context,
+                                       buff, sizeof(buff));
+    if (read == -EAGAIN) continue;
+    if (read < 0) return LP_ERROR_MIDI_READ;
+    for (ssize_t i = 0; i < read; ++i)
+    {
+      if (buff[i] == 0xF0)
+      {
+        in_sysex = true;
+        reply_size = 0;
+      }
+      if (!in_sysex) continue;
+      if (reply_size < sizeof(reply)) reply[reply_size] = buff[i];
+      reply_size++;
+      if (buff[i] != 0xF7) continue;
+      in_sysex = false;
+      if (lp_parse_device_inquiry(reply, reply_size, capabilities))
+        return LP_OK;
+    }
+  }
+}
+
+LIBLAUNCHPAD_DEF int _lp_key_index(LPNoteKey key)
+{
+  if (key >= LP_KEY_AUTOMAP(0))
+    return (key < LP_KEY_AUTOMAP(LP_COLS))
+      ? LP_FRAME_AUTOMAP(key - LP_KEY_AUTOMAP(0)) : -1;
+  int row = key / 0x10;
+  int col = key % 0x10;
+  if (row >= LP_ROWS) return -1;
+  if (col < LP_COLS) return LP_FRAME_GRID(row, col);
+  if (col == LP_COLS) return LP_FRAME_SCENE(row);
+  return -1;
+}
+
+LIBLAUNCHPAD_DEF LPNoteKey _lp_index_key(int index)
+{
+  if (index >= LP_FRAME_AUTOMAP(0))
+    return LP_KEY_AUTOMAP(index - LP_FRAME_AUTOMAP(0));
+  if (index >= LP_FRAME_SCENE(0))
+  {
+    int row = index - LP_FRAME_SCENE(0);
+    return LP_KEY(row, LP_COLS);
+  }
+  int row = index / LP_COLS;
+  int col = index % LP_COLS;
+  return LP_KEY(row, col);
 }
   
 #endif // LIBLAUNCHPAD_IMPLEMENTATION
@@ -3,9 +3,13 @@
 // Mail:    giovanni.santini@proton.me
 // Github:  @San7o
 
+#define _POSIX_C_SOURCE 199309L
+
 #define MICRO_TESTS_IMPLEMENTATION
 #include "micro-tests.h"
 
+// Built once with the defaults, and once with LIBLAUNCHPAD_THREADED
+// and LIBLAUNCHPAD_FRAME_CACHE defined
 #define LIBLAUNCHPAD_IMPLEMENTATION
 #include "../liblaunchpad.h"
 
@@ -74,6 +78,34 @@ TEST(lp_tests, set_multiple_notes)
   TEST_SUCCESS;
 }
 
+TEST(lp_tests, batch)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+
+  ASSERT(lp_begin_batch(&lp) == LP_OK);
+  for (int i = 0; i < LP_ROWS; ++i)
+    for (int j = 0; j < LP_COLS; ++j)
+      ASSERT(lp_set_note(&lp,
+                         LP_NOTE(LP_NOTE_ON, LP_KEY(i,j), LP_COLOR_RED_FULL))
+             == LP_OK);
+  ASSERT(lp_flush(&lp, true) == LP_OK);
+  sleep(1);
+
+  ASSERT(lp_begin_batch(&lp) == LP_OK);
+  for (int i = 0; i < LP_ROWS; ++i)
+    for (int j = 0; j < LP_COLS; ++j)
+      ASSERT(lp_set_note(&lp,
+                         LP_NOTE(LP_NOTE_ON, LP_KEY(i,j), LP_COLOR_GREEN_FULL))
+             == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
 TEST(lp_tests, double_buffering)
 {
   LP lp;
@@ -121,4 +153,1285 @@ TEST(lp_tests, double_buffering)
   TEST_SUCCESS;
 }
 
+TEST(lp_tests, set_frame)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+
+  LPNoteColor frame[LP_LEDS];
+  for (int i = 0; i < LP_LEDS; ++i)
+    frame[i] = LP_COLOR_GREEN_FULL;
+  ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+  sleep(1);
+
+  for (int i = 0; i < LP_ROWS; ++i)
+  {
+    frame[LP_FRAME_GRID(i, i)] = LP_COLOR_RED_FULL;
+    frame[LP_FRAME_SCENE(i)]   = LP_COLOR_YELLOW_FULL;
+    frame[LP_FRAME_AUTOMAP(i)] = LP_COLOR_RED_LOW;
+  }
+  ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, present)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  LPNoteColor frame[LP_LEDS] = {0};
+  for (int i = 0; i < LP_ROWS; ++i)
+  {
+    frame[LP_FRAME_GRID(i, i)] = LP_COLOR_GREEN_FULL;
+    ASSERT(lp_present(&lp, frame) == LP_OK);
+    ASSERT(lp.shadow[lp.update_buff][LP_FRAME_GRID(i, i)]
+           == LP_COLOR_GREEN_FULL);
+  }
+  sleep(1);
+
+  for (int i = 0; i < LP_LEDS; ++i)
+    frame[i] = LP_COLOR_RED_FULL;
+  ASSERT(lp_present(&lp, frame) == LP_OK);
+  ASSERT(memcmp(lp.shadow[lp.update_buff], frame, sizeof(frame)) == 0);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+#ifdef LIBLAUNCHPAD_THREADED
+
+TEST(lp_tests, writer_thread)
+{
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.threaded = true;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+
+  for (int i = 0; i < LP_ROWS; ++i)
+    for (int j = 0; j < LP_COLS; ++j)
+      ASSERT(lp_set_note(&lp,
+                         LP_NOTE(LP_NOTE_ON, LP_KEY(i,j), LP_COLOR_GREEN_FULL))
+             == LP_OK);
+  ASSERT(lp_flush(&lp, true) == LP_OK);
+  ASSERT(lp.rings[LP_PRIORITY_NORMAL].tail
+         == lp.rings[LP_PRIORITY_NORMAL].head);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, submit_frame)
+{
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.threaded = true;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+
+  LPNoteColor frame[LP_LEDS];
+  for (int k = 0; k < 1000; ++k)
+  {
+    for (int i = 0; i < LP_LEDS; ++i)
+      frame[i] = ((i + k / 10) % 2) ? LP_COLOR_GREEN_FULL : LP_COLOR_RED_FULL;
+    ASSERT(lp_submit_frame(&lp, frame) == LP_OK);
+  }
+  ASSERT(lp_flush(&lp, true) == LP_OK);
+  ASSERT(memcmp(lp.shadow[lp.update_buff], frame, sizeof(frame)) == 0);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+#endif // LIBLAUNCHPAD_THREADED
+
+TEST(lp_tests, priority)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  LPNoteColor frame[LP_LEDS];
+  for (int i = 0; i < LP_LEDS; ++i)
+    frame[i] = LP_COLOR_GREEN_LOW;
+
+  ASSERT(lp_begin_batch(&lp) == LP_OK);
+  ASSERT(lp_set_priority(&lp, LP_PRIORITY_BULK) == LP_OK);
+  ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+  ASSERT(lp_set_priority(&lp, LP_PRIORITY_INTERACTIVE) == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0,0), LP_COLOR_RED_FULL))
+         == LP_OK);
+  // Sent before the frame, which then overwrites it
+  ASSERT(lp.shadow[lp.update_buff][LP_FRAME_GRID(0, 0)] == LP_COLOR_UNKNOWN);
+  ASSERT(lp_flush(&lp, true) == LP_OK);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, coalescing)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_set_coalescing(&lp, 1000000) == LP_OK);
+
+  for (int k = 0; k < 8; ++k)
+    for (int j = 0; j < LP_COLS; ++j)
+      ASSERT(lp_set_note(&lp, LP_NOTE(LP_NOTE_ON, LP_KEY(0,j),
+                                      (k % 2) ? LP_COLOR_GREEN_FULL
+                                              : LP_COLOR_RED_FULL))
+             == LP_OK);
+  // Only the last color of each key is held
+  ASSERT(lp.coalesced_count == LP_COLS);
+  ASSERT(lp.shadow[lp.update_buff][LP_FRAME_GRID(0, 0)]
+         == LP_COLOR_GREEN_FULL);
+
+  ASSERT(lp_set_coalescing(&lp, 0) == LP_OK);
+  ASSERT(lp.coalesced_count == 0);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, nonblocking_output)
+{
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.nonblocking_output = true;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+  ASSERT(lp_reset(&lp) >= 0);
+
+  LPNoteColor frame[LP_LEDS];
+  for (int k = 0; k < 100; ++k)
+  {
+    for (int i = 0; i < LP_LEDS; ++i)
+      frame[i] = ((i + k) % 2) ? LP_COLOR_GREEN_FULL : LP_COLOR_RED_FULL;
+    int err = lp_set_frame(&lp, frame);
+    while (err == LP_ERROR_WOULD_BLOCK)
+    {
+      struct pollfd pfds[4];
+      int count = lp_output_descriptors(&lp, pfds, 4);
+      ASSERT(count > 0);
+      poll(pfds, count, -1);
+      ASSERT(lp_resume(&lp) >= 0);
+      err = lp_set_frame(&lp, frame);
+    }
+    ASSERT(err == LP_OK || err == LP_PENDING);
+  }
+
+  int err;
+  while ((err = lp_resume(&lp)) == LP_PENDING)
+  {
+    struct pollfd pfds[4];
+    poll(pfds, lp_output_descriptors(&lp, pfds, 4), -1);
+  }
+  ASSERT(err == LP_OK);
+  ASSERT(lp.unsent_size == 0);
+  sleep(1);
+
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, midi_params)
+{
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.params.out_buffer_size = 256;
+  options.params.out_avail_min = 32;
+  options.params.no_active_sensing = true;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+
+  LPMidiParams params;
+  ASSERT(lp_get_midi_params(&lp, &params) == LP_OK);
+  ASSERT(params.out_buffer_size >= 256);
+  ASSERT(params.out_avail_min == 32);
+  ASSERT(params.no_active_sensing);
+  ASSERT(params.in_buffer_size > 0);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, encode)
+{
+  unsigned char buff[LP_FRAME_MESSAGE_SIZE];
+
+  ASSERT(lp_encode_reset(buff) == LP_MESSAGE_SIZE);
+  ASSERT(buff[0] == 0xB0 && buff[1] == 0 && buff[2] == 0);
+
+  ASSERT(lp_encode_note(buff, LP_NOTE(LP_NOTE_ON, LP_KEY(1,2),
+                                      LP_COLOR_RED_FULL))
+         == LP_MESSAGE_SIZE);
+  ASSERT(buff[0] == LP_NOTE_ON && buff[1] == 0x12
+         && buff[2] == LP_COLOR_RED_FULL);
+
+  ASSERT(lp_encode_automap(buff, 3, LP_COLOR_GREEN_FULL) == LP_MESSAGE_SIZE);
+  ASSERT(buff[0] == 0xB0 && buff[1] == 0x6B
+         && buff[2] == LP_COLOR_GREEN_FULL);
+
+  ASSERT(lp_encode_flashing(buff, true) == LP_MESSAGE_SIZE);
+  ASSERT(buff[2] == 0x28);
+  ASSERT(lp_encode_flashing(buff, false) == LP_MESSAGE_SIZE);
+  ASSERT(buff[2] == 0x21);
+
+  ASSERT(lp_encode_duty_cycle(buff, 1, 5) == LP_MESSAGE_SIZE);
+  ASSERT(buff[0] == 0xB0 && buff[1] == 0x1E && buff[2] == 0x02);
+  ASSERT(lp_encode_duty_cycle(buff, 10, 18) == LP_MESSAGE_SIZE);
+  ASSERT(buff[0] == 0xB0 && buff[1] == 0x1F && buff[2] == 0x1F);
+  ASSERT(lp_encode_duty_cycle(buff, 0, 5) == 0);
+
+  LPNoteColor frame[LP_LEDS] = { 0 };
+  ASSERT(lp_encode_frame(buff, frame) == LP_FRAME_MESSAGE_SIZE);
+  ASSERT(buff[3] == LP_RAPID_UPDATE);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, command_buffer)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  unsigned char storage[4 * LP_FRAME_MESSAGE_SIZE];
+  LPCommandBuffer command_buffer;
+  ASSERT(lp_command_buffer_init(&command_buffer, storage, sizeof(storage))
+         == LP_OK);
+
+  LPNoteColor frame[LP_LEDS];
+  ASSERT(lp_begin_record(&lp, &command_buffer) == LP_OK);
+  for (int k = 0; k < 4; ++k)
+  {
+    for (int i = 0; i < LP_LEDS; ++i)
+      frame[i] = ((i + k) % 4 == 0) ? LP_COLOR_YELLOW_FULL : 0;
+    ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+  }
+  ASSERT(lp_set_note(&lp, LP_NOTE(LP_NOTE_ON, LP_KEY(0,0), LP_COLOR_RED_FULL))
+         == LP_ERROR_BUFFER_FULL);
+  ASSERT(lp_end_record(&lp) == LP_OK);
+  ASSERT(command_buffer.size == sizeof(storage));
+
+  for (int k = 0; k < 10; ++k)
+  {
+    ASSERT(lp_replay(&lp, &command_buffer) == LP_OK);
+    ASSERT(memcmp(lp.shadow[lp.update_buff], frame, sizeof(frame)) == 0);
+  }
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, frame_cache)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  LPNoteColor frame[LP_LEDS];
+  for (int k = 0; k < 20; ++k)
+  {
+    for (int i = 0; i < LP_LEDS; ++i)
+      frame[i] = ((i + k) % 2) ? LP_COLOR_GREEN_LOW : LP_COLOR_RED_LOW;
+    ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+  }
+
+  size_t hits, misses;
+#ifdef LIBLAUNCHPAD_FRAME_CACHE
+  ASSERT(lp_frame_cache_stats(&lp, &hits, &misses) == LP_OK);
+  ASSERT(misses == 2);
+  ASSERT(hits == 18);
+#else
+  ASSERT(lp_frame_cache_stats(&lp, &hits, &misses)
+         == LP_ERROR_UNSUPPORTED);
+#endif
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, pages)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  LPNoteColor red[LP_LEDS], green[LP_LEDS];
+  for (int i = 0; i < LP_LEDS; ++i)
+  {
+    red[i] = LP_COLOR_RED_LOW;
+    green[i] = LP_COLOR_GREEN_LOW;
+  }
+  int page_red = lp_add_page(&lp, "red", red);
+  int page_green = lp_add_page(&lp, "green", green);
+  ASSERT(page_red >= 0 && page_green >= 0);
+  ASSERT(lp_find_page(&lp, "green") == page_green);
+  ASSERT(lp_find_page(&lp, "blue") == LP_ERROR_NO_PAGE);
+
+  ASSERT(lp_show_page(&lp, page_red) == LP_OK);
+  sleep(1);
+  ASSERT(lp_show_page(&lp, page_green) == LP_OK);
+  sleep(1);
+  // Red is still in the hidden buffer
+  ASSERT(memcmp(lp.shadow[!lp.current_buff], red, sizeof(red)) == 0);
+  ASSERT(lp_show_page(&lp, page_red) == LP_OK);
+  ASSERT(lp_set_page_led(&lp, page_red, LP_FRAME_GRID(0, 0),
+                         LP_COLOR_YELLOW_FULL) == LP_OK);
+  ASSERT(lp.shadow[lp.current_buff][LP_FRAME_GRID(0, 0)]
+         == LP_COLOR_YELLOW_FULL);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, begin_end_frame)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  LPNoteColor frame[LP_LEDS] = { 0 };
+  for (int k = 0; k < LP_ROWS * LP_COLS; ++k)
+  {
+    ASSERT(lp_begin_frame(&lp) == LP_OK);
+    ASSERT(lp.update_buff != lp.current_buff);
+    frame[k] = (k % 2) ? LP_COLOR_GREEN_FULL : LP_COLOR_RED_FULL;
+    ASSERT(lp_present(&lp, frame) == LP_OK);
+    ASSERT(lp_end_frame(&lp) == LP_OK);
+    ASSERT(memcmp(lp.shadow[lp.current_buff], frame, sizeof(frame)) == 0);
+    nanosleep(&(struct timespec){ .tv_nsec = 20000000 }, NULL);
+  }
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, blinking)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  ASSERT(lp_set_blinking(&lp, LP_KEY(0,0), LP_COLOR_RED_FULL, 0) == LP_OK);
+  ASSERT(lp.flashing);
+  ASSERT(lp_set_blinking(&lp, LP_KEY(0,1), LP_COLOR_RED_FULL,
+                         LP_COLOR_GREEN_FULL) == LP_OK);
+  ASSERT(lp_set_blinking(&lp, LP_KEY(0,2), LP_COLOR_YELLOW_FULL,
+                         LP_COLOR_YELLOW_FULL) == LP_OK);
+  int i = LP_FRAME_GRID(0, 1);
+  ASSERT(lp.shadow[0][i] != lp.shadow[1][i]);
+  i = LP_FRAME_GRID(0, 2);
+  ASSERT(lp.shadow[0][i] == lp.shadow[1][i]);
+  sleep(2);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, dimmer)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  LPNoteColor frame[LP_LEDS];
+  for (int i = 0; i < LP_LEDS; ++i)
+    frame[i] = LP_COLOR_YELLOW_FULL;
+  ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+
+  ASSERT(lp_set_duty_cycle(&lp, 0, 5) == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_set_duty_cycle(&lp, 16, 18) == LP_OK);
+  ASSERT(lp.duty_numerator == 16 && lp.duty_denominator == 18);
+  for (int k = 100; k >= 0; --k)
+  {
+    ASSERT(lp_set_dimmer(&lp, k / 100.0) == LP_OK);
+    nanosleep(&(struct timespec){ .tv_nsec = 20000000 }, NULL);
+  }
+  ASSERT(lp.duty_numerator == 1 && lp.duty_denominator == 18);
+  sleep(1);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp.duty_numerator == 1 && lp.duty_denominator == 5);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, scroll_text)
+{
+  unsigned char buff[LP_TEXT_MESSAGE_SIZE(3)];
+  ASSERT(lp_encode_text(buff, "Hi\xE9", LP_COLOR_RED_FULL, 4, true)
+         == LP_TEXT_MESSAGE_SIZE(3));
+  ASSERT(buff[5] == (LP_COLOR_RED_FULL | 0x40) && buff[6] == 4);
+  ASSERT(buff[7] == 'H' && buff[9] == '?' && buff[10] == 0xF7);
+  unsigned char stop[] = { 0xF0, 0x00, 0x20, 0x29, 0x09, 0x00, 0xF7 };
+  ASSERT(lp_encode_text(buff, "", LP_COLOR_RED_FULL, 4, true)
+         == sizeof(stop));
+  ASSERT(memcmp(buff, stop, sizeof(stop)) == 0);
+  ASSERT(lp_encode_text(buff, "Hi", 0, 8, false) == 0);
+
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  ASSERT(lp_scroll_text(&lp, "Hi", LP_COLOR_GREEN_FULL, 8, false)
+         == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_scroll_text(&lp, "Hi", LP_COLOR_GREEN_FULL, 7, false) == LP_OK);
+  ASSERT(lp.shadow[lp.current_buff][LP_FRAME_GRID(0, 0)] == LP_COLOR_UNKNOWN);
+  ASSERT(lp.shadow[lp.current_buff][LP_FRAME_SCENE(0)] == 0);
+  sleep(2);
+  ASSERT(lp_scroll_text(&lp, "", 0, 0, false) == LP_OK);
+
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, fill)
+{
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  ASSERT(lp_fill(&lp, LP_COLOR_YELLOW_MEDIUM) == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_AUTOMAP(7)] == LP_COLOR_YELLOW_MEDIUM);
+  ASSERT(lp.shadow[1][0] == LP_COLOR_UNKNOWN);
+  sleep(1);
+
+  ASSERT(lp_clear_region(&lp, 6, 6, 3, 3) == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_clear_region(&lp, 2, 2, 4, 7) == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_SCENE(5)] == 0);
+  ASSERT(lp.shadow[0][LP_FRAME_GRID(1, 2)] == LP_COLOR_YELLOW_MEDIUM);
+  sleep(1);
+
+  ASSERT(lp_fill(&lp, LP_COLOR_RED_FULL) == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_GRID(3, 3)] == LP_COLOR_RED_FULL);
+  sleep(1);
+
+  ASSERT(lp_fill(&lp, 0) == LP_OK);
+  ASSERT(lp.shadow[0][0] == 0 && lp.shadow[1][0] == 0);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, set_leds)
+{
+  unsigned char buff[LP_MESSAGE_SIZE];
+  ASSERT(lp_encode_note(buff, LP_NOTE(LP_NOTE_OFF, LP_KEY_AUTOMAP(2),
+                                      LP_COLOR_RED_FULL)) == LP_MESSAGE_SIZE);
+  ASSERT(buff[0] == 0xB0 && buff[1] == 0x6A && buff[2] == 0);
+
+  LP lp;
+  ASSERT(lp_open(&lp, LP_DEVICENAME, false) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  LPNote notes[] = {
+    LP_NOTE(LP_NOTE_ON, LP_KEY_AUTOMAP(0), LP_COLOR_RED_FULL),
+    LP_NOTE(LP_NOTE_ON, LP_KEY(0, LP_COLS), LP_COLOR_GREEN_FULL),
+    LP_NOTE(LP_NOTE_ON, LP_KEY(3, 3), LP_COLOR_YELLOW_FULL),
+    LP_NOTE(LP_NOTE_ON, LP_KEY_AUTOMAP(0), LP_COLOR_GREEN_LOW),
+  };
+  ASSERT(lp_set_leds(&lp, notes, 4) == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_AUTOMAP(0)] == LP_COLOR_GREEN_LOW);
+  ASSERT(lp.shadow[0][LP_FRAME_SCENE(0)] == LP_COLOR_GREEN_FULL);
+  ASSERT(lp.shadow[0][LP_FRAME_GRID(3, 3)] == LP_COLOR_YELLOW_FULL);
+
+  notes[0].key = LP_KEY_AUTOMAP(LP_COLS);
+  ASSERT(lp_set_leds(&lp, notes, 1) == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_set_note(&lp, LP_NOTE(LP_NOTE_OFF, LP_KEY_AUTOMAP(0), 0))
+         == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_AUTOMAP(0)] == 0);
+  sleep(1);
+
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, drum_rack_layout)
+{
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.layout = LP_LAYOUT_DRUM_RACK;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+  ASSERT(lp.layout_notes[LP_KEY(7, 0)] == 36);
+  ASSERT(lp.layout_notes[LP_KEY(0, 7)] == 99);
+  ASSERT(lp.layout_notes[LP_KEY(0, LP_COLS)] == 107);
+  ASSERT(lp.layout_keys[68] == LP_KEY(7, 4));
+  ASSERT(lp.layout_keys[0] == LP_KEY_NONE);
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_set_note(&lp, LP_NOTE(LP_NOTE_ON, LP_KEY(7, 0),
+                                  LP_COLOR_RED_FULL)) == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_GRID(7, 0)] == LP_COLOR_RED_FULL);
+  LPNoteColor frame[LP_LEDS];
+  for (int i = 0; i < LP_LEDS; ++i)
+    frame[i] = (i % 2) ? LP_COLOR_GREEN_FULL : LP_COLOR_RED_LOW;
+  ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+  sleep(1);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  options.layout = 3;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_ERROR_UNSUPPORTED);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, capabilities)
+{
+  unsigned char reply[LP_INQUIRY_REPLY_SIZE] = {
+    0xF0, 0x7E, 0x00, 0x06, 0x02, 0x00, 0x20, 0x29, 0x20, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x04, 0x02, 0xF7,
+  };
+  LPCapabilities capabilities;
+  ASSERT(lp_parse_device_inquiry(reply, sizeof(reply), &capabilities));
+  ASSERT(capabilities.model == LP_MODEL_LAUNCHPAD_S);
+  ASSERT(capabilities.firmware == 142);
+  ASSERT(!lp_parse_device_inquiry(reply, sizeof(reply) - 1, &capabilities));
+
+  LPCapabilityCache cache;
+  ASSERT(lp_capability_cache_init(&cache) == LP_OK);
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.probe = true;
+  options.capability_cache = &cache;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+  ASSERT(lp_get_capabilities(&lp, &capabilities) == LP_OK);
+  ASSERT(capabilities.model != LP_MODEL_UNKNOWN);
+  ASSERT(capabilities.flags & LP_CAPABILITY_RAPID_UPDATE);
+  ASSERT(lp_close(&lp) == LP_OK);
+  ASSERT(cache.entries[0].used);
+
+  // The second time the capabilities come from the cache
+  cache.entries[0].capabilities.flags = 0;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+  ASSERT(lp_scroll_text(&lp, "Hi", LP_COLOR_RED_FULL, 0, false)
+         == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_enable_flashing(&lp) == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, rgb)
+{
+  LPNoteColor frame[LP_LEDS];
+  memset(frame, LP_COLOR_UNKNOWN, sizeof(frame));
+  frame[LP_FRAME_GRID(0, 0)] = LP_COLOR_YELLOW_MEDIUM;
+  frame[LP_FRAME_SCENE(7)] = LP_COLOR_RED_FULL;
+  unsigned char buff[LP_RGB_MESSAGE_SIZE(LP_LEDS)];
+  ASSERT(lp_encode_rgb(buff, LP_MODEL_LAUNCHPAD_S, frame) == 0);
+  ASSERT(lp_encode_rgb(buff, LP_MODEL_LAUNCHPAD_MK2, frame)
+         == LP_RGB_MESSAGE_SIZE(2));
+  ASSERT(buff[5] == 0x18 && buff[6] == 0x0B);
+  ASSERT(buff[7] == 81 && buff[8] == 42 && buff[9] == 42 && buff[10] == 0);
+  ASSERT(buff[11] == 19 && buff[12] == 63 && buff[13] == 0);
+  ASSERT(lp_encode_rgb(buff, LP_MODEL_LAUNCHPAD_PRO, frame)
+         == LP_RGB_MESSAGE_SIZE(2));
+  ASSERT(buff[5] == 0x10 && buff[7] == 81 && buff[11] == 19);
+
+  // The Automap row is addressed differently by each model
+  memset(frame, LP_COLOR_UNKNOWN, sizeof(frame));
+  frame[LP_FRAME_AUTOMAP(0)] = LP_COLOR_GREEN_FULL;
+  frame[LP_FRAME_AUTOMAP(7)] = LP_COLOR_GREEN_FULL;
+  ASSERT(lp_encode_rgb(buff, LP_MODEL_LAUNCHPAD_MK2, frame)
+         == LP_RGB_MESSAGE_SIZE(2));
+  ASSERT(buff[7] == 104 && buff[11] == 111);
+  ASSERT(lp_encode_rgb(buff, LP_MODEL_LAUNCHPAD_PRO, frame)
+         == LP_RGB_MESSAGE_SIZE(2));
+  ASSERT(buff[7] == 91 && buff[11] == 98);
+
+  // Pretend an RGB model was probed before
+  LPCapabilityCache cache;
+  ASSERT(lp_capability_cache_init(&cache) == LP_OK);
+  cache.entries[0].used = true;
+  strcpy(cache.entries[0].devicename, LP_DEVICENAME);
+  cache.entries[0].capabilities = (LPCapabilities){
+    LP_MODEL_LAUNCHPAD_MK2, 0, LP_CAPABILITY_RGB
+  };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.probe = true;
+  options.capability_cache = &cache;
+  ASSERT(lp_open_ex(&lp, LP_DEVICENAME, &options) == LP_OK);
+  ASSERT(lp.layout_notes[LP_KEY(0, 0)] == 81);
+  ASSERT(lp.layout_keys[19] == LP_KEY(7, LP_COLS));
+
+  ASSERT(lp_reset(&lp) == LP_OK);
+  for (int i = 0; i < LP_LEDS; ++i)
+    frame[i] = (i % 3) ? LP_COLOR_GREEN_LOW : LP_COLOR_RED_MEDIUM;
+  ASSERT(lp_set_frame(&lp, frame) == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_AUTOMAP(7)] == frame[LP_FRAME_AUTOMAP(7)]);
+  frame[LP_FRAME_GRID(4, 4)] = LP_COLOR_YELLOW_FULL;
+  ASSERT(lp_present(&lp, frame) == LP_OK);
+  ASSERT(lp_fill(&lp, 0) == LP_OK);
+  ASSERT(lp.shadow[0][LP_FRAME_GRID(4, 4)] == 0);
+  ASSERT(lp_swap_buffers(&lp) == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_set_duty_cycle(&lp, 1, 5) == LP_ERROR_UNSUPPORTED);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+// Transport keeping in memory what is written and what is to be read
+typedef struct {
+  unsigned char written[2048];
+  size_t written_size;
+  // Number of successful writes
+  int writes;
+  unsigned char input[32];
+  size_t input_size;
+  // Negative errno returned by the next write, or 0
+  int write_error;
+  // Bytes reported as still waiting to be sent to the device
+  size_t queued;
+  // Negative errno returned when asked not to block, or 0
+  int nonblocking_error;
+  bool closed;
+} MemoryTransport;
+
+static ssize_t
+memory_write(void *context, const unsigned char *buff, size_t size)
+{
+  MemoryTransport *memory = context;
+  if (memory->write_error < 0) return memory->write_error;
+  if (memory->written_size + size > sizeof(memory->written)) return -ENOSPC;
+  memcpy(memory->written + memory->written_size, buff, size);
+  memory->written_size += size;
+  memory->writes++;
+  return size;
+}
+
+static ssize_t memory_read(void *context, unsigned char *buff, size_t size)
+{
+  MemoryTransport *memory = context;
+  if (memory->input_size == 0) return -EAGAIN;
+  if (size > memory->input_size) size = memory->input_size;
+  memcpy(buff, memory->input, size);
+  memory->input_size -= size;
+  memmove(memory->input, memory->input + size, memory->input_size);
+  return size;
+}
+
+static int memory_poll_descriptors(void *context, bool output,
+                                   struct pollfd *pfds, unsigned int space)
+{
+  (void) context; (void) output; (void) pfds; (void) space;
+  return 0;
+}
+
+static int memory_set_nonblocking(void *context, bool output, bool nonblocking)
+{
+  MemoryTransport *memory = context;
+  (void) output;
+  return nonblocking ? memory->nonblocking_error : 0;
+}
+
+static int memory_flush(void *context)
+{
+  (void) context;
+  return 0;
+}
+
+static size_t memory_queued(void *context)
+{
+  MemoryTransport *memory = context;
+  return memory->queued;
+}
+
+static int memory_close(void *context)
+{
+  MemoryTransport *memory = context;
+  memory->closed = true;
+  return 0;
+}
+
+static const LPTransport memory_transport = {
+  .write = memory_write,
+  .read = memory_read,
+  .poll_descriptors = memory_poll_descriptors,
+  .set_nonblocking = memory_set_nonblocking,
+  .flush = memory_flush,
+  .queued = memory_queued,
+  .close = memory_close,
+};
+
+TEST(lp_tests, transport)
+{
+  // Reply of a Launchpad Mini with firmware 0104
+  MemoryTransport memory = {
+    .input = { 0xF0, 0x7E, 0x00, 0x06, 0x02, 0x00, 0x20, 0x29, 0x36,
+               0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x04, 0xF7 },
+    .input_size = LP_INQUIRY_REPLY_SIZE,
+  };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.nonblocking = true;
+  options.probe = true;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options) == LP_OK);
+  ASSERT(memory.written_size == LP_INQUIRY_MESSAGE_SIZE);
+  ASSERT(memory.written[0] == 0xF0 && memory.written[5] == 0xF7);
+
+  LPCapabilities capabilities;
+  ASSERT(lp_get_capabilities(&lp, &capabilities) == LP_OK);
+  ASSERT(capabilities.model == LP_MODEL_LAUNCHPAD_MINI);
+  ASSERT(capabilities.firmware == 104);
+
+  LPEvent event;
+  ASSERT(lp_check_event(&lp, &event) == 0);
+  memory.input[0] = 0x90;
+  memory.input[1] = LP_KEY(1, 2);
+  memory.input[2] = 0x7F;
+  memory.input_size = 3;
+  ASSERT(lp_check_event(&lp, &event) > 0);
+  ASSERT(event.type == LP_EVENT_PRESSED);
+  ASSERT(event.note_y == 1 && event.note_x == 2);
+
+  memory.written_size = 0;
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 0), LP_COLOR_RED_FULL))
+         == LP_OK);
+  ASSERT(memory.written_size == 3);
+  ASSERT(memory.written[0] == 0x90 && memory.written[1] == LP_KEY(0, 0));
+  ASSERT(memory.written[2] == LP_COLOR_RED_FULL);
+
+  ASSERT(lp_close(&lp) == LP_OK);
+  ASSERT(memory.closed);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_OFF, LP_KEY(0, 0), 0))
+         == LP_ERROR_UNINITIALIZED);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, running_status)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  // Repeated note on status bytes are dropped
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 0), LP_COLOR_RED_FULL))
+         == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 1), LP_COLOR_RED_FULL))
+         == LP_OK);
+  // A CC ends the run
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 1), LP_COLOR_RED_FULL))
+         == LP_OK);
+  const unsigned char red = LP_COLOR_RED_FULL;
+  const unsigned char expected[] = { 0x90, 0x00, red, 0x01, red,
+                                     0xB0, 0x00, 0x00, 0x90, 0x01, red };
+  ASSERT(memory.written_size == sizeof(expected));
+  ASSERT(memcmp(memory.written, expected, sizeof(expected)) == 0);
+
+  // A failed write ends the run
+  memory.write_error = -EIO;
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 2), LP_COLOR_RED_FULL))
+         == LP_ERROR_MIDI_WRITE);
+  memory.write_error = 0;
+  memory.written_size = 0;
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 2), LP_COLOR_RED_FULL))
+         == LP_OK);
+  ASSERT(memory.written_size == 3 && memory.written[0] == 0x90);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  // So does opening again
+  memory.written_size = 0;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 3), LP_COLOR_RED_FULL))
+         == LP_OK);
+  ASSERT(memory.written_size == 3 && memory.written[0] == 0x90);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, close_after_error)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+#ifdef LIBLAUNCHPAD_THREADED
+  options.threaded = true;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  // The writer thread fails and still has to be stopped
+  memory.write_error = -EIO;
+  lp_set_note(&lp, LP_NOTE(LP_NOTE_ON, LP_KEY(0, 0), LP_COLOR_RED_FULL));
+  ASSERT(lp_close(&lp) == LP_ERROR_MIDI_WRITE);
+  ASSERT(!lp.threaded);
+  ASSERT(memory.closed);
+  memory = (MemoryTransport){ 0 };
+  options.threaded = false;
+#endif
+
+  // Without the writer thread the last messages fail on close
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  ASSERT(lp_begin_batch(&lp) == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 0), LP_COLOR_RED_FULL))
+         == LP_OK);
+  memory.write_error = -EIO;
+  ASSERT(lp_close(&lp) == LP_ERROR_MIDI_WRITE);
+  ASSERT(memory.closed);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, submit_frame_lane)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  LPNoteColor frame[LP_LEDS];
+  memset(frame, LP_COLOR_GREEN_LOW, sizeof(frame));
+  ASSERT(lp_begin_batch(&lp) == LP_OK);
+  ASSERT(lp_set_priority(&lp, LP_PRIORITY_BULK) == LP_OK);
+  ASSERT(lp_submit_frame(&lp, frame) == LP_OK);
+  ASSERT(lp.mailbox_full);
+
+  // The frame stays in the bulk lane behind an interactive note
+  ASSERT(lp_set_priority(&lp, LP_PRIORITY_INTERACTIVE) == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 0), LP_COLOR_RED_FULL))
+         == LP_OK);
+  ASSERT(lp.out_size[LP_PRIORITY_INTERACTIVE] == 3);
+  ASSERT(lp.out_size[LP_PRIORITY_BULK] == lp.mailbox_size);
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+  ASSERT(memory.written_size > 3 + 3);
+  ASSERT(memory.written[0] == 0x90 && memory.written[1] == LP_KEY(0, 0));
+  ASSERT(memory.written[3] == 0xB0);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, coalescing_deadline)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+#ifdef LIBLAUNCHPAD_THREADED
+  options.threaded = true;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  // The writer thread closes the window without any other call
+  ASSERT(lp_set_coalescing(&lp, 1000) == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 0), LP_COLOR_RED_FULL))
+         == LP_OK);
+  struct timespec wait = { 0, 20 * 1000 * 1000 };
+  nanosleep(&wait, NULL);
+  ASSERT(__atomic_load_n(&memory.written_size, __ATOMIC_ACQUIRE) == 3);
+  ASSERT(memory.written[0] == 0x90 && memory.written[1] == LP_KEY(0, 0));
+  ASSERT(lp_close(&lp) == LP_OK);
+  memory = (MemoryTransport){ 0 };
+  options.threaded = false;
+#endif
+
+  // Without the writer thread, a blocking read writes the notes first
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  ASSERT(lp_set_coalescing(&lp, 1000 * 1000) == LP_OK);
+  ASSERT(lp_set_note(&lp,
+                     LP_NOTE(LP_NOTE_ON, LP_KEY(0, 0), LP_COLOR_RED_FULL))
+         == LP_OK);
+  ASSERT(memory.written_size == 0);
+  LPEvent event;
+  ASSERT(lp_check_event(&lp, &event) == 0);
+  ASSERT(memory.written_size == 3);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, replay_single_write)
+{
+  unsigned char buff[2 * LIBLAUNCHPAD_OUT_BUFFER_SIZE];
+  LPCommandBuffer command_buffer;
+  ASSERT(lp_command_buffer_init(&command_buffer, buff, sizeof(buff))
+         == LP_OK);
+
+  MemoryTransport memory = { 0 };
+  LP lp;
+  lp.transport = NULL;
+  ASSERT(lp_begin_record(&lp, &command_buffer) == LP_ERROR_UNINITIALIZED);
+  ASSERT(lp_end_record(&lp) == LP_ERROR_UNINITIALIZED);
+  ASSERT(lp_replay(&lp, &command_buffer) == LP_ERROR_UNINITIALIZED);
+
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  // A recording stops growing at the size of the output buffer
+  ASSERT(lp_begin_record(&lp, &command_buffer) == LP_OK);
+  int err = LP_OK;
+  for (int i = 0; err == LP_OK; ++i)
+    err = lp_set_note(&lp, LP_NOTE(LP_NOTE_ON, LP_KEY(i % LP_ROWS, 0),
+                                   LP_COLOR_RED_FULL));
+  ASSERT(err == LP_ERROR_BUFFER_FULL);
+  ASSERT(command_buffer.size <= LIBLAUNCHPAD_OUT_BUFFER_SIZE);
+  ASSERT(command_buffer.size + LP_MESSAGE_SIZE
+         > LIBLAUNCHPAD_OUT_BUFFER_SIZE);
+  ASSERT(lp_end_record(&lp) == LP_OK);
+
+  // Replayed with a single write, even after other messages
+  ASSERT(lp_begin_batch(&lp) == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+  ASSERT(lp_replay(&lp, &command_buffer) == LP_OK);
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+  ASSERT(memory.writes == 2);
+  memory.writes = 0;
+  ASSERT(lp_replay(&lp, &command_buffer) == LP_OK);
+  ASSERT(memory.writes == 1);
+
+  // Recordings filled by hand cannot be replayed at once
+  command_buffer.size = LIBLAUNCHPAD_OUT_BUFFER_SIZE + 1;
+  ASSERT(lp_replay(&lp, &command_buffer) == LP_ERROR_BUFFER_FULL);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, page_names)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  lp.transport = NULL;
+  ASSERT(lp_add_page(&lp, "red", NULL) == LP_ERROR_UNINITIALIZED);
+
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  char name[LIBLAUNCHPAD_PAGE_NAME_SIZE + 1];
+  memset(name, 'a', sizeof(name));
+  name[LIBLAUNCHPAD_PAGE_NAME_SIZE] = '\0';
+  ASSERT(lp_add_page(&lp, name, NULL) == LP_ERROR_NAME_TOO_LONG);
+
+  // Names sharing a prefix are different pages
+  name[LIBLAUNCHPAD_PAGE_NAME_SIZE - 1] = '\0';
+  int page = lp_add_page(&lp, name, NULL);
+  ASSERT(page >= 0);
+  ASSERT(lp_find_page(&lp, name) == page);
+  name[LIBLAUNCHPAD_PAGE_NAME_SIZE - 1] = 'b';
+  ASSERT(lp_find_page(&lp, name) == LP_ERROR_NO_PAGE);
+  name[LIBLAUNCHPAD_PAGE_NAME_SIZE - 2] = '\0';
+  ASSERT(lp_find_page(&lp, name) == LP_ERROR_NO_PAGE);
+
+  // A page that could not be written is not shown
+  LPNoteColor frame[LP_LEDS];
+  memset(frame, LP_COLOR_RED_FULL, sizeof(frame));
+  int red = lp_add_page(&lp, "red", frame);
+  ASSERT(red >= 0);
+  memory.write_error = -EIO;
+  ASSERT(lp_show_page(&lp, red) == LP_ERROR_MIDI_WRITE);
+  ASSERT(lp.active_page == -1);
+  memory.write_error = 0;
+  ASSERT(lp_show_page(&lp, red) == LP_OK);
+  ASSERT(lp.active_page == red);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, blinking_copy)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  ASSERT(lp_reset(&lp) == LP_OK);
+
+  // Set in the displayed buffer only, so the buffers differ
+  ASSERT(lp_set_note(&lp, LP_NOTE(LP_NOTE_ON, LP_KEY(0,0),
+                                  LP_COLOR_RED_FULL)) == LP_OK);
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+  memory.written_size = 0;
+
+  ASSERT(lp_set_blinking(&lp, LP_KEY(1,1), LP_COLOR_RED_FULL, 0) == LP_OK);
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+  unsigned char expected[] = {
+    0xB0, 0x00, 0x20 | _lp_buffer_flags(0, 1) | LP_DOUBLE_BUFFERING_COPY,
+    0xB0, 0x00, 0x28,
+  };
+  ASSERT(memory.written_size > sizeof(expected));
+  ASSERT(memcmp(memory.written, expected, sizeof(expected)) == 0);
+
+  // Only the blinking LED differs between the buffers
+  for (int i = 0; i < LP_LEDS; ++i)
+    ASSERT((lp.shadow[0][i] == lp.shadow[1][i])
+           == (i != LP_FRAME_GRID(1, 1)));
+
+  // Once flashing, the buffers are not copied again
+  memory.written_size = 0;
+  ASSERT(lp_set_blinking(&lp, LP_KEY(2,2), LP_COLOR_RED_FULL, 0) == LP_OK);
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+  ASSERT(memory.written[0] != 0xB0);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, drum_rack_events)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.nonblocking = true;
+  options.layout = LP_LAYOUT_DRUM_RACK;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  LPEvent event = { 0 };
+  memory.input[0] = 0x90;
+  memory.input[1] = 68;
+  memory.input[2] = 0x7F;
+  memory.input_size = 3;
+  ASSERT(lp_check_event(&lp, &event) > 0);
+  ASSERT(event.type == LP_EVENT_PRESSED);
+  ASSERT(event.note_y == 7 && event.note_x == 4);
+
+  // Notes below 36 are not on the grid
+  event = (LPEvent){ 0 };
+  memory.input[1] = 5;
+  memory.input_size = 3;
+  ASSERT(lp_check_event(&lp, &event) == 0);
+  ASSERT(event.type == 0);
+  ASSERT(memory.input_size == 0);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+// Read the event of the three bytes [status], [data1] and [data2]
+static int memory_event(LP *lp, MemoryTransport *memory, LPEvent *event,
+                        unsigned char status, unsigned char data1,
+                        unsigned char data2)
+{
+  memory->input[0] = status;
+  memory->input[1] = data1;
+  memory->input[2] = data2;
+  memory->input_size = 3;
+  *event = (LPEvent){ 0 };
+  return lp_check_event(lp, event);
+}
+
+TEST(lp_tests, rgb_events)
+{
+  // Reply of a Launchpad MK2, then of a Launchpad Pro
+  unsigned char reply[LP_INQUIRY_REPLY_SIZE] = {
+    0xF0, 0x7E, 0x00, 0x06, 0x02, 0x00, 0x20, 0x29, 0x69,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x04, 0xF7
+  };
+  MemoryTransport memory = { 0 };
+  memcpy(memory.input, reply, sizeof(reply));
+  memory.input_size = sizeof(reply);
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.nonblocking = true;
+  options.probe = true;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  ASSERT(lp.capabilities.model == LP_MODEL_LAUNCHPAD_MK2);
+
+  LPEvent event;
+  ASSERT(memory_event(&lp, &memory, &event, 0x90, 11, 0x7F) > 0);
+  ASSERT(event.type == LP_EVENT_PRESSED);
+  ASSERT(event.note_y == 7 && event.note_x == 0);
+  ASSERT(memory_event(&lp, &memory, &event, 0x90, 89, 0x7F) > 0);
+  ASSERT(event.type == LP_EVENT_PRESSED);
+  ASSERT(event.note_y == 0 && event.note_x == LP_COLS);
+  ASSERT(memory_event(&lp, &memory, &event, 0xB0, 105, 0x7F) > 0);
+  ASSERT(event.type == LP_EVENT_AUTOMAP_PRESSED && event.note_x == 1);
+  ASSERT(memory_event(&lp, &memory, &event, 0xB0, 91, 0x7F) == 0);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  memory = (MemoryTransport){ 0 };
+  reply[8] = 0x51;
+  memcpy(memory.input, reply, sizeof(reply));
+  memory.input_size = sizeof(reply);
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  ASSERT(lp.capabilities.model == LP_MODEL_LAUNCHPAD_PRO);
+
+  ASSERT(memory_event(&lp, &memory, &event, 0x90, 11, 0) > 0);
+  ASSERT(event.type == LP_EVENT_RELEASED);
+  ASSERT(event.note_y == 7 && event.note_x == 0);
+  // The side buttons send control changes
+  ASSERT(memory_event(&lp, &memory, &event, 0xB0, 19, 0x7F) > 0);
+  ASSERT(event.type == LP_EVENT_PRESSED);
+  ASSERT(event.note_y == 7 && event.note_x == LP_COLS);
+  ASSERT(memory_event(&lp, &memory, &event, 0xB0, 98, 0) > 0);
+  ASSERT(event.type == LP_EVENT_AUTOMAP_RELEASED && event.note_x == 7);
+  // The left column and the bottom row have no key
+  ASSERT(memory_event(&lp, &memory, &event, 0xB0, 10, 0x7F) == 0);
+  ASSERT(memory_event(&lp, &memory, &event, 0xB0, 1, 0x7F) == 0);
+  ASSERT(memory_event(&lp, &memory, &event, 0xB0, 104, 0x7F) == 0);
+
+  // The Automap row is set through its LEDs above the grid
+  memory.written_size = 0;
+  ASSERT(lp_set_note(&lp, LP_NOTE(LP_NOTE_ON, LP_KEY_AUTOMAP(2),
+                                  LP_COLOR_RED_FULL)) == LP_OK);
+  ASSERT(memory.written_size == LP_RGB_MESSAGE_SIZE(1));
+  ASSERT(memory.written[5] == 0x10 && memory.written[7] == 93);
+  ASSERT(lp.shadow[0][LP_FRAME_AUTOMAP(2)] == LP_COLOR_RED_FULL);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, pace_held_frame)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  // The frame waits while the device is busy
+  LPNoteColor frame[LP_LEDS];
+  memset(frame, LP_COLOR_RED_FULL, sizeof(frame));
+  memory.queued = 100;
+  memory.written_size = 0;
+  ASSERT(lp_submit_frame(&lp, frame) == LP_OK);
+  ASSERT(memory.written_size == 0);
+  ASSERT(lp_pace(&lp) == LP_OK);
+  ASSERT(memory.written_size == 0);
+
+  // Then goes out with the next frame interval, without other writes
+  memory.queued = 0;
+  ASSERT(lp_pace(&lp) == LP_OK);
+  ASSERT(memory.written_size > 0);
+  ASSERT(!lp.mailbox_full);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+TEST(lp_tests, nonblocking_refused)
+{
+  MemoryTransport memory = { .nonblocking_error = -EINVAL };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.nonblocking_output = true;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_ERROR_OPENING_LAUNCHPAD);
+  ASSERT(memory.closed);
+
+  memory = (MemoryTransport){ .nonblocking_error = -EINVAL };
+  options.nonblocking_output = false;
+  options.nonblocking = true;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_ERROR_OPENING_LAUNCHPAD);
+  ASSERT(memory.closed);
+
+  // Blocking in both directions needs nothing from the transport
+  memory = (MemoryTransport){ .nonblocking_error = -EINVAL };
+  options.nonblocking = false;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+  ASSERT(!lp.nonblocking_output);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+#ifdef LIBLAUNCHPAD_THREADED
+
+TEST(lp_tests, mailbox_order)
+{
+  MemoryTransport memory = { 0 };
+  LP lp;
+  LPOptions options = LP_OPTIONS_DEFAULT;
+  options.threaded = true;
+  ASSERT(lp_open_transport(&lp, &memory_transport, &memory, &options)
+         == LP_OK);
+
+  // Let the writer go idle, hold it after it finds the rings empty,
+  // then write a note and submit a frame as the producer would
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+  nanosleep(&(struct timespec){ .tv_nsec = 20000000 }, NULL);
+  memory.written_size = 0;
+  pthread_mutex_lock(&lp.mailbox_lock);
+  sem_post(&lp.writer_sem);
+  nanosleep(&(struct timespec){ .tv_nsec = 20000000 }, NULL);
+  unsigned char note[] = { 0x90, LP_KEY(0, 0), LP_COLOR_RED_FULL };
+  _lp_ring_push(&lp.rings[LP_PRIORITY_NORMAL], &lp.writer_sem,
+                note, sizeof(note));
+  unsigned char frame[] = { 0xB0, 0x00, 0x01, 0x92, 0x00, 0x00 };
+  memcpy(lp.mailbox, frame, sizeof(frame));
+  lp.mailbox_size = sizeof(frame);
+  lp.mailbox_priority = LP_PRIORITY_NORMAL;
+  lp.mailbox_full = true;
+  pthread_mutex_unlock(&lp.mailbox_lock);
+  nanosleep(&(struct timespec){ .tv_nsec = 20000000 }, NULL);
+
+  ASSERT(lp_flush(&lp, false) == LP_OK);
+  ASSERT(memory.written_size == sizeof(note) + sizeof(frame));
+  ASSERT(memcmp(memory.written, note, sizeof(note)) == 0);
+  ASSERT(memcmp(memory.written + sizeof(note), frame, sizeof(frame)) == 0);
+  ASSERT(lp_close(&lp) == LP_OK);
+
+  TEST_SUCCESS;
+}
+
+#endif // LIBLAUNCHPAD_THREADED
+
 MICRO_TESTS_MAIN